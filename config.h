@@ -53,12 +53,15 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (8, or 16 when built with ALIGNMENT=16)
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8  
+#endif
 
 /* 
- * Maximum heap size in bytes 
+ * Smallest heap size in bytes memlib settles for when it cannot reserve
+ * the address space it was asked for (see mem_init)
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
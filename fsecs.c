@@ -54,4 +54,11 @@ double fsecs(fsecs_test_funct f, void *argp)
 #endif 
 }
 
-
+/*
+ * fsecs_once - Return the running time of a single run of f (in
+ *     seconds), for functions that take too long to run repeatedly
+ */
+double fsecs_once(fsecs_test_funct f, void *argp)
+{
+    return ftimer_gettod(f, argp, 1);
+}
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE  /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,11 +16,20 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -29,9 +39,12 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define STREAM_CHUNK 4096 /* requests read at a time from a streamed trace */
+#define LIVE_BITS     10 /* log2 of the buckets a streamed trace starts with */
+#define REPLAY_RUNS    3 /* runs of each threaded replay; the fastest counts */
 
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
+/* Returns true if p is align-byte aligned */
+#define IS_ALIGNED(p, align)  ((((size_t)(p)) % (align)) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -41,25 +54,44 @@
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo (or next free record) */
+    struct range_t *right; /* ranges above hi */
+    unsigned prio;         /* treap priority, highest at the root */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
-} traceop_t;
+/* Records a live block of a streamed trace, in a hash table by id */
+typedef struct block_t {
+    int id;                /* block id in the trace */
+    char *p;               /* the block's payload... */
+    size_t size;           /* ... and its size in bytes */
+    struct block_t *next;  /* next block in its bucket (or next free record) */
+} block_t;
 
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc ids */
-    int num_ops;         /* number of distinct requests */
+    long num_ops;        /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or a chunk of them */
     char **blocks;       /* array of ptrs returned by malloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a .rbin file that ops points into */
+    size_t map_size;     /* ... and its length */
+    FILE *stream;        /* file a streamed trace is read from, or NULL */
+    char *stream_name;   /* ... its name, for error messages */
+    int stream_rbin;     /* is that file in the .rbin format? */
+    long stream_start;   /* offset of its first request */
+    long chunk_base;     /* number of the first request in ops... */
+    long chunk_end;      /* ... and of the first one past them */
+    FILE *spool;         /* copy of the requests of a stream that cannot
+			    seek, while the stream is being read */
+    block_t **live;      /* live blocks of a streamed trace, by id... */
+    int live_bits;       /* ... log2 of the number of buckets... */
+    int num_live;        /* ... and the number of blocks in the table */
+    char **batch;        /* the blocks of a batch request of a streamed
+			    trace... */
+    int batch_size;      /* ... and how many it has room for */
 } trace_t;
 
 /* 
@@ -85,6 +117,27 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a worker process sends back when it has evaluated its trace */
+typedef struct {
+    stats_t stats;   /* the stats for the trace */
+    int errors;      /* number of errs it found in the student malloc */
+} result_t;
+
+/* Holds the params and results of one thread of a threaded replay */
+typedef struct {
+    trace_t *trace;           /* the trace replayed */
+    int libc;                 /* replay with libc malloc rather than mm? */
+    int *opnums;              /* the requests to make, or NULL for all */
+    int num_ops;              /* ... and how many there are */
+    int *seqs;                /* for each block of each request, the number
+                                 of requests on the block before it */
+    int *done;                /* number of requests done on each block, or
+                                 NULL if the thread has blocks of its own */
+    char **blocks;            /* pointers to the blocks of the trace */
+    pthread_barrier_t *start; /* where the threads wait to start together */
+    double begin, end;        /* when the thread started and finished */
+} replay_t;
+
 /********************
  * Global variables
  *******************/
@@ -106,15 +159,28 @@ static char *default_tracefiles[] = {
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum);
+static int add_range(range_t **ranges, char *lo, int size, int align,
+		     int tracenum, long opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *stream_trace(char *filename);
 static void free_trace(trace_t *trace);
 
+/* These functions evaluate a malloc package on one trace or on all */
+static void eval_trace(char *tracefile, int tracenum, int libc, int streaming,
+		       stats_t *stats);
+static void eval_traces(char **tracefiles, int n, int libc, int streaming,
+			int jobs, int pin, stats_t *stats);
+
+/* These functions replay traces on several threads at once */
+static void *replay_thread(void *ptr);
+static double replay_trace(trace_t *trace, int k, int libc, int split,
+			   int *ops, double *secs);
+static void eval_scaling(char **tracefiles, int n, int libc, int max_threads);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -129,7 +195,7 @@ static void eval_mm_speed(void *ptr);
 static void printresults(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
-static void malloc_error(int tracenum, int opnum, char *msg);
+static void malloc_error(int tracenum, long opnum, char *msg);
 static void app_error(char *msg);
 
 /**************
@@ -141,13 +207,14 @@ int main(int argc, char **argv)
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    int streaming = 0;   /* If set, stream the one trace file (set by -s) */
+    int jobs = 0;        /* If set, number of worker processes (set by -j) */
+    int pin = 0;         /* If set, pin the workers to CPUs (set by -p) */
+    int max_threads = 0; /* If set, replay on 1 to this many threads (-T) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
 
     /* temporaries used to compute the performance index */
@@ -157,7 +224,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgl")) != EOF) {
+    while ((c = getopt(argc, argv, "f:s:t:j:pT:hvVgl")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -171,6 +238,30 @@ int main(int argc, char **argv)
             tracefiles[1] = NULL;
             verbose = 2;
             break;
+	case 's': /* Stream one trace file (relative to curr dir, - for stdin) */
+	    num_tracefiles = 1;
+	    streaming = 1;
+	    if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+		unix_error("ERROR: realloc failed in main");
+	    tracefiles[0] = strdup(optarg);
+	    tracefiles[1] = NULL;
+	    verbose = 2;
+	    break;
+	case 'j': /* Evaluate the traces in up to this many worker processes */
+	    if ((jobs = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'p': /* Pin the worker processes to separate CPUs */
+	    pin = 1;
+	    break;
+	case 'T': /* Replay the traces on 1 to this many threads at once */
+	    if ((max_threads = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
 	case 't': /* Directory where the traces are located */
 	    if (num_tracefiles == 1) /* ignore if -f already encountered */
 		break;
@@ -209,6 +300,28 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /*
+     * With -T, measure how the packages scale with the number of
+     * threads instead
+     */
+    if (max_threads > 0) {
+	if (streaming) {
+	    usage();
+	    exit(1);
+	}
+	mem_init();
+	if (run_libc)
+	    eval_scaling(tracefiles, num_tracefiles, 1, max_threads);
+	eval_scaling(tracefiles, num_tracefiles, 0, max_threads);
+	exit(0);
+    }
+
+    /* stdin can be streamed to only one of the packages */
+    if (streaming && run_libc && strcmp(tracefiles[0], "-") == 0) {
+	usage();
+	exit(1);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package 
      */
@@ -222,20 +335,7 @@ int main(int argc, char **argv)
 	    unix_error("libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
-	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
-	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
-		speed_params.trace = trace;
-		if (verbose > 1)
-		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	    free_trace(trace);
-	}
+	eval_traces(tracefiles, num_tracefiles, 1, streaming, jobs, pin, libc_stats);
 
 	/* Display the libc results in a compact table */
 	if (verbose) {
@@ -255,28 +355,9 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
-
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    /* Evaluate student's mm malloc package using the K-best scheme; the
+     * simulated memory system in memlib.c is set up by eval_traces */
+    eval_traces(tracefiles, num_tracefiles, 0, streaming, jobs, pin, mm_stats);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -340,37 +421,577 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines evaluate a malloc package on each trace,
+ * either one trace after another in this process, or in worker
+ * processes that evaluate one trace each, several at once.
+ ****************************************************************/
+
+/*
+ * eval_trace - Evaluate the libc malloc package (if libc is set) or the
+ *     mm malloc package on trace tracenum, and fill in its stats.  The
+ *     caller has set up the memlib heap for the mm package.
+ */
+static void eval_trace(char *tracefile, int tracenum, int libc, int streaming,
+	stats_t *stats)
+{
+    static range_t *ranges = NULL; /* keeps track of block extents */
+    trace_t *trace;                /* stores the trace (or a chunk of it) */
+    speed_t speed_params;          /* input parameters to the xx_speed routines */ 
+
+    trace = streaming ? stream_trace(tracefile) :
+	read_trace(tracedir, tracefile);
+    if (libc) {
+	if (verbose > 1)
+	    printf("Checking libc malloc for correctness, ");
+	stats->valid = eval_libc_valid(trace, tracenum);
+	stats->ops = trace->num_ops;
+	if (stats->valid) {
+	    speed_params.trace = trace;
+	    if (verbose > 1)
+		printf("and performance.\n");
+	    stats->secs = streaming ?
+		fsecs_once(eval_libc_speed, &speed_params) :
+		fsecs(eval_libc_speed, &speed_params);
+	}
+    } else {
+	if (verbose > 1)
+	    printf("Checking mm_malloc for correctness, ");
+	stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+	stats->ops = trace->num_ops;
+	if (stats->valid) {
+	    if (verbose > 1)
+		printf("efficiency, ");
+	    stats->util = eval_mm_util(trace, tracenum, &ranges);
+	    speed_params.trace = trace;
+	    speed_params.ranges = ranges;
+	    if (verbose > 1)
+		printf("and performance.\n");
+	    stats->secs = streaming ?
+		fsecs_once(eval_mm_speed, &speed_params) :
+		fsecs(eval_mm_speed, &speed_params);
+	}
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_traces - Evaluate the libc malloc package (if libc is set) or the
+ *     mm malloc package on each of the n traces, and fill in their stats.
+ *     If jobs is 0 the traces are evaluated one after another.  Otherwise
+ *     each trace is evaluated by a worker process of its own, up to jobs
+ *     of them at once; a worker sets up a memlib heap (and so an mm 
+ *     package) of its own, and sends its stats back over a pipe.  If pin
+ *     is set, the workers running at once are pinned to different CPUs,
+ *     as far as there are enough of them, so that they disturb each 
+ *     other's timing as little as possible.
+ */
+static void eval_traces(char **tracefiles, int n, int libc, int streaming,
+	int jobs, int pin, stats_t *stats)
+{
+    pid_t *pids;            /* the worker in each slot, or 0 */
+    int *fds;               /* ... the read end of its pipe */
+    int *tracenums;         /* ... and the trace it evaluates */
+    int cpus[CPU_SETSIZE];  /* the CPUs we may run on */
+    int ncpus = 0;
+    cpu_set_t set;
+    result_t result;
+    int fd[2];
+    int i, slot, running, status;
+    pid_t pid;
+
+    if (jobs == 0) {
+	if (!libc)
+	    mem_init();
+	for (i = 0; i < n; i++)
+	    eval_trace(tracefiles[i], i, libc, streaming, &stats[i]);
+	return;
+    }
+
+    if (pin) {
+	if (sched_getaffinity(0, sizeof(set), &set) < 0)
+	    unix_error("sched_getaffinity failed in eval_traces");
+	for (i = 0; i < CPU_SETSIZE; i++)
+	    if (CPU_ISSET(i, &set))
+		cpus[ncpus++] = i;
+    }
+    if ((pids = (pid_t *)calloc(jobs, sizeof(pid_t))) == NULL ||
+	    (fds = (int *)calloc(jobs, sizeof(int))) == NULL ||
+	    (tracenums = (int *)calloc(jobs, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_traces");
+
+    i = 0;
+    running = 0;
+    while (i < n || running > 0) {
+
+	/* Start a worker on the next trace while a slot is free */
+	if (i < n && running < jobs) {
+	    for (slot = 0; pids[slot] != 0; slot++)
+		;
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_traces");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_traces");
+	    if (pid == 0) {
+		close(fd[0]);
+		if (pin) {
+		    CPU_ZERO(&set);
+		    CPU_SET(cpus[slot % ncpus], &set);
+		    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			unix_error("sched_setaffinity failed in eval_traces");
+		}
+		if (!libc)
+		    mem_init();
+		memset(&result, 0, sizeof(result));
+		eval_trace(tracefiles[i], i, libc, streaming, &result.stats);
+		result.errors = errors;
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+		    unix_error("write failed in eval_traces");
+		exit(0);
+	    }
+	    close(fd[1]);
+	    pids[slot] = pid;
+	    fds[slot] = fd[0];
+	    tracenums[slot] = i++;
+	    running++;
+	    continue;
+	}
+
+	/* Collect the stats of the next worker to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_traces");
+	for (slot = 0; slot < jobs && pids[slot] != pid; slot++)
+	    ;
+	if (slot == jobs)
+	    continue;
+	if (read(fds[slot], &result, sizeof(result)) == sizeof(result)) {
+	    stats[tracenums[slot]] = result.stats;
+	    errors += result.errors;
+	} else {
+	    /* The worker exited or was killed before it could report */
+	    errors++;
+	    if (WIFSIGNALED(status))
+		printf("ERROR [trace %d]: worker killed by signal %d\n",
+			tracenums[slot], WTERMSIG(status));
+	    else
+		printf("ERROR [trace %d]: worker exited with status %d\n",
+			tracenums[slot], WEXITSTATUS(status));
+	}
+	close(fds[slot]);
+	pids[slot] = 0;
+	running--;
+    }
+    free(pids);
+    free(fds);
+    free(tracenums);
+}
+
+
+/*****************************************************************
+ * The following routines replay a trace on several threads at once,
+ * to measure how a malloc package scales with the number of threads.
+ * Either each of the k threads replays a copy of the whole trace, or,
+ * if the requests of the trace carry thread numbers, thread t of k 
+ * makes the requests of trace threads t, t+k, t+2k, ... in trace
+ * order.  A request then waits until the requests that come before
+ * it in the trace on the same blocks are done, whichever threads
+ * make them, so that a block freed by another thread than the one
+ * that allocated it is not freed too early.
+ ****************************************************************/
+
+/*
+ * now - Return the time in seconds on a clock that only goes forward
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * replay_thread - Make the requests of one replay thread, once all the
+ *     threads are ready, and time them
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    traceop_t *op;
+    int *seq = r->seqs;
+    int i, j, index, size;
+    char *p;
+
+    pthread_barrier_wait(r->start);
+    r->begin = now();
+    for (i = 0; i < r->num_ops; i++) {
+	op = &r->trace->ops[(r->opnums != NULL) ? r->opnums[i] : i];
+	index = op->index;
+	size = op->size;
+
+	/* Wait for the requests before this one on its blocks */
+	if (r->done != NULL)
+	    for (j = 0; j < OP_IDS(op); j++, seq++)
+		while (__atomic_load_n(&r->done[index + j], __ATOMIC_ACQUIRE) != *seq)
+		    sched_yield();
+
+	switch (op->type) {
+
+	case ALLOC: /* malloc */
+	    p = r->libc ? malloc(size) : mm_malloc(size);
+	    if (p == NULL)
+		app_error("malloc failed in replay_thread");
+	    r->blocks[index] = p;
+	    break;
+
+	case CALLOC: /* calloc */
+	    p = r->libc ? calloc(op->nmemb, size / op->nmemb) :
+		mm_calloc(op->nmemb, size / op->nmemb);
+	    if (p == NULL)
+		app_error("calloc failed in replay_thread");
+	    r->blocks[index] = p;
+	    break;
+
+	case ALIGNED_ALLOC: /* aligned_alloc */
+	    p = r->libc ? aligned_alloc(op->align, size) :
+		mm_aligned_alloc(op->align, size);
+	    if (p == NULL)
+		app_error("aligned_alloc failed in replay_thread");
+	    r->blocks[index] = p;
+	    break;
+
+	case FREE: /* free */
+	    if (r->libc)
+		free(r->blocks[index]);
+	    else
+		mm_free(r->blocks[index]);
+	    break;
+
+	case FREE_SIZED: /* sized free; libc has none */
+	    if (r->libc)
+		free(r->blocks[index]);
+	    else
+		mm_free_sized(r->blocks[index], size);
+	    break;
+
+	case ALLOC_BATCH: /* batch malloc; one malloc per block for libc */
+	    if (r->libc) {
+		for (j = 0; j < op->count; j++)
+		    if ((r->blocks[index + j] = malloc(size)) == NULL)
+			app_error("malloc failed in replay_thread");
+	    } else if (mm_malloc_batch(size, op->count,
+			(void **)&r->blocks[index]) != op->count)
+		app_error("mm_malloc_batch failed in replay_thread");
+	    break;
+
+	case FREE_BATCH: /* batch free; one free per block for libc */
+	    if (r->libc)
+		for (j = 0; j < op->count; j++)
+		    free(r->blocks[index + j]);
+	    else
+		mm_free_batch((void **)&r->blocks[index], op->count);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+	}
+
+	/* Let the requests after this one on its blocks go ahead */
+	if (r->done != NULL)
+	    for (j = 0; j < OP_IDS(op); j++)
+		__atomic_store_n(&r->done[index + j], r->done[index + j] + 1,
+			__ATOMIC_RELEASE);
+    }
+    r->end = now();
+    return NULL;
+}
+
+/*
+ * replay_trace - Replay the trace on k threads at once, with libc 
+ *     malloc if libc is set or else with the mm package, and return the
+ *     time from the start of the first thread to the end of the last.
+ *     The requests of the trace are split among the threads by thread
+ *     number if split is set, and are all made by each thread otherwise.
+ *     The number of requests each thread made, and the time it took, are
+ *     left in ops[0..k-1] and secs[0..k-1].
+ */
+static double replay_trace(trace_t *trace, int k, int libc, int split,
+	int *ops, double *secs)
+{
+    replay_t *r;
+    pthread_t *tids;
+    pthread_barrier_t start;
+    int *done = NULL;    /* requests done on each block, when split */
+    int *fill = NULL;    /* requests handed out to each thread so far */
+    int i, j, t, n;
+    double begin, end;
+
+    if ((r = (replay_t *)calloc(k, sizeof(replay_t))) == NULL ||
+	    (tids = (pthread_t *)calloc(k, sizeof(pthread_t))) == NULL)
+	unix_error("calloc failed in replay_trace");
+    for (t = 0; t < k; t++) {
+	r[t].trace = trace;
+	r[t].libc = libc;
+	r[t].start = &start;
+    }
+
+    if (!split) {
+	/* Every thread makes all the requests, on blocks of its own */
+	for (t = 0; t < k; t++) {
+	    r[t].num_ops = trace->num_ops;
+	    if ((r[t].blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+		unix_error("malloc failed in replay_trace");
+	}
+    } else {
+	/* 
+	 * Hand each request to its thread, along with the number of 
+	 * requests before it on each of its blocks (counted in done,
+	 * which then starts over as the count of requests done)
+	 */
+	if ((done = (int *)calloc(trace->num_ids, sizeof(int))) == NULL ||
+		(fill = (int *)calloc(k, sizeof(int))) == NULL)
+	    unix_error("calloc failed in replay_trace");
+	for (i = 0; i < trace->num_ops; i++) {
+	    t = trace->ops[i].thread % k;
+	    r[t].num_ops++;
+	    fill[t] += OP_IDS(&trace->ops[i]);
+	}
+	for (t = 0; t < k; t++) {
+	    if ((r[t].opnums = (int *)malloc((r[t].num_ops + 1) * sizeof(int))) == NULL ||
+		    (r[t].seqs = (int *)malloc((fill[t] + 1) * sizeof(int))) == NULL)
+		unix_error("malloc failed in replay_trace");
+	    r[t].num_ops = fill[t] = 0;
+	    r[t].done = done;
+	    r[t].blocks = trace->blocks;
+	}
+	for (i = 0; i < trace->num_ops; i++) {
+	    t = trace->ops[i].thread % k;
+	    r[t].opnums[r[t].num_ops++] = i;
+	    n = OP_IDS(&trace->ops[i]);
+	    for (j = 0; j < n; j++)
+		r[t].seqs[fill[t]++] = done[trace->ops[i].index + j]++;
+	}
+	memset(done, 0, trace->num_ids * sizeof(int));
+    }
+
+    /* Reset the heap and initialize the mm package */
+    if (!libc) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in replay_trace");
+    }
+
+    /* Start the threads together and wait for them all */
+    pthread_barrier_init(&start, NULL, k);
+    for (t = 0; t < k; t++)
+	if (pthread_create(&tids[t], NULL, replay_thread, &r[t]) != 0)
+	    app_error("pthread_create failed in replay_trace");
+    for (t = 0; t < k; t++)
+	pthread_join(tids[t], NULL);
+    pthread_barrier_destroy(&start);
+
+    /* The replay took from the first start to the last finish */
+    begin = r[0].begin;
+    end = r[0].end;
+    for (t = 0; t < k; t++) {
+	begin = (r[t].begin < begin) ? r[t].begin : begin;
+	end = (r[t].end > end) ? r[t].end : end;
+	ops[t] = r[t].num_ops;
+	secs[t] = r[t].end - r[t].begin;
+	if (!split)
+	    free(r[t].blocks);
+	free(r[t].opnums);
+	free(r[t].seqs);
+    }
+    free(done);
+    free(fill);
+    free(tids);
+    free(r);
+    return end - begin;
+}
+
+/*
+ * eval_scaling - Replay each of the n traces on 1 to max_threads threads
+ *     with libc malloc (if libc is set) or the mm package, and print the
+ *     aggregate and per-thread throughputs, and the speedup over one
+ *     thread.  Each replay is run REPLAY_RUNS times and the fastest run
+ *     counts.
+ */
+static void eval_scaling(char **tracefiles, int n, int libc, int max_threads)
+{
+    trace_t *trace;
+    int *ops, *best_ops;
+    double *secs, *best_secs;
+    double wall, best, total, base = 0;
+    int i, k, run, t, split;
+
+    if ((ops = (int *)malloc(max_threads * sizeof(int))) == NULL ||
+	    (best_ops = (int *)malloc(max_threads * sizeof(int))) == NULL ||
+	    (secs = (double *)malloc(max_threads * sizeof(double))) == NULL ||
+	    (best_secs = (double *)malloc(max_threads * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_scaling");
+
+    for (i = 0; i < n; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+
+	/* The trace is split by thread if it names more than one */
+	split = 0;
+	for (t = 0; t < trace->num_ops; t++)
+	    if (trace->ops[t].thread != 0)
+		split = 1;
+
+	printf("\nThreaded replay of %s with %s malloc (%s):\n", tracefiles[i],
+		libc ? "libc" : "mm", split ? "split by thread" : "a copy per thread");
+	printf("%7s%10s%8s  %s\n", "threads", "Kops", "speedup", "Kops per thread");
+	for (k = 1; k <= max_threads; k++) {
+	    best = 0;
+	    for (run = 0; run < REPLAY_RUNS; run++) {
+		wall = replay_trace(trace, k, libc, split, ops, secs);
+		if (best == 0 || wall < best) {
+		    best = wall;
+		    memcpy(best_ops, ops, k * sizeof(int));
+		    memcpy(best_secs, secs, k * sizeof(double));
+		}
+	    }
+	    total = 0;
+	    for (t = 0; t < k; t++)
+		total += best_ops[t];
+	    if (k == 1)
+		base = total / best;
+	    printf("%7d%10.0f%8.2f ", k, (total / 1e3) / best, (total / best) / base);
+	    for (t = 0; t < k; t++)
+		printf(" %.0f", (best_ops[t] / 1e3) / best_secs[t]);
+	    printf("\n");
+	}
+	free_trace(trace);
+    }
+    free(ops);
+    free(best_ops);
+    free(secs);
+    free(best_secs);
+}
+
+
+/*****************************************************************
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
+ *
+ * The tree is a treap: a binary search tree ordered by lo, which is
+ * also a heap ordered by a random priority, so that it stays balanced
+ * in expectation. Since the ranges in it never overlap, a new payload
+ * overlaps one of them iff it overlaps the range with the highest lo
+ * at or below its own hi, and every check, insert and removal takes
+ * O(log n) steps.
  ****************************************************************/
 
+/* Range records are carved from chunks of RANGE_CHUNK records and
+ * recycled through a free list, rather than malloc'd one at a time */
+#define RANGE_CHUNK 4096
+static range_t *free_ranges = NULL; /* recycled records, linked by left */
+static unsigned range_seed = 1;     /* xorshift state for priorities */
+
+/*
+ * new_range - Take a range record from the pool, with a fresh priority
+ */
+static range_t *new_range(void)
+{
+    range_t *p;
+    int i;
+
+    if (free_ranges == NULL) {
+	if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in new_range");
+	for (i = 0; i < RANGE_CHUNK; i++) {
+	    p[i].left = free_ranges;
+	    free_ranges = &p[i];
+	}
+    }
+    p = free_ranges;
+    free_ranges = p->left;
+    range_seed ^= range_seed << 13;
+    range_seed ^= range_seed >> 17;
+    range_seed ^= range_seed << 5;
+    p->prio = range_seed;
+    p->left = p->right = NULL;
+    return p;
+}
+
+/*
+ * insert_range - Insert record p into the subtree at root, returning
+ *     the new root of the subtree
+ */
+static range_t *insert_range(range_t *root, range_t *p)
+{
+    range_t *child;
+
+    if (root == NULL)
+	return p;
+    if (p->lo < root->lo) {
+	child = root->left = insert_range(root->left, p);
+	if (child->prio > root->prio) {
+	    root->left = child->right;
+	    child->right = root;
+	    return child;
+	}
+    }
+    else {
+	child = root->right = insert_range(root->right, p);
+	if (child->prio > root->prio) {
+	    root->right = child->left;
+	    child->left = root;
+	    return child;
+	}
+    }
+    return root;
+}
+
+/*
+ * join_ranges - Join the subtrees a and b, where all of a's ranges lie
+ *     below all of b's, returning the root of the joined tree
+ */
+static range_t *join_ranges(range_t *a, range_t *b)
+{
+    if (a == NULL)
+	return b;
+    if (b == NULL)
+	return a;
+    if (a->prio > b->prio) {
+	a->right = join_ranges(a->right, b);
+	return a;
+    }
+    b->left = join_ranges(a, b->left);
+    return b;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     size bytes at addr lo, aligned to align bytes. After checking the
+ *     block for correctness,
+ *     we create a range struct for this block and add it to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum)
+static int add_range(range_t **ranges, char *lo, int size, int align,
+		     int tracenum, long opnum)
 {
     char *hi = lo + size - 1;
     range_t *p;
+    range_t *below;
     char msg[MAXLINE];
 
     assert(size > 0);
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
+    /* Payload addresses must be aligned as the request asked */
+    if (!IS_ALIGNED(lo, align)) {
 	sprintf(msg, "Payload address (%p) not aligned to %d bytes", 
-		lo, ALIGNMENT);
+		lo, align);
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of one of
+     * the allocator's own mappings */
+    if (!mem_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -378,26 +999,26 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    below = NULL;
+    for (p = *ranges;  p != NULL;  p = (p->lo <= hi) ? p->right : p->left) {
+	if (p->lo <= hi)
+	    below = p;
+    }
+    if (below != NULL && below->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, below->lo, below->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = new_range();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    *ranges = insert_range(*ranges, p);
     return 1;
 }
 
@@ -407,17 +1028,13 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+
+    while ((p = *ranges) != NULL && p->lo != lo)
+	ranges = (lo < p->lo) ? &p->left : &p->right;
+    if (p != NULL) {
+	*ranges = join_ranges(p->left, p->right);
+	p->left = free_ranges;
+	free_ranges = p;
     }
 }
 
@@ -426,52 +1043,436 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    p->left = free_ranges;
+    free_ranges = p;
+    *ranges = NULL;
+}
+
+
+/*****************************************************************
+ * The following routines keep track of the blocks of a trace by id.
+ * The pointers and sizes of the blocks of a trace that is read in
+ * full are kept in arrays indexed by id.  A streamed trace keeps
+ * its live blocks in a hash table instead, so that the memory it
+ * needs follows the number of blocks live at once rather than the
+ * largest id it uses.
+ ****************************************************************/
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/* Block records are carved from chunks of BLOCK_CHUNK records and
+ * recycled through a free list, like range records */
+#define BLOCK_CHUNK 4096
+static block_t *free_blocks = NULL; /* recycled records, linked by next */
+
+/* The bucket of id in a table of 2^bits buckets */
+#define BLOCK_HASH(id, bits) (((unsigned)(id) * 2654435761u) >> (32 - (bits)))
+
+/*
+ * new_block - Take a block record from the pool
+ */
+static block_t *new_block(void)
+{
+    block_t *b;
+    int i;
+
+    if (free_blocks == NULL) {
+	if ((b = (block_t *)malloc(BLOCK_CHUNK * sizeof(block_t))) == NULL)
+	    unix_error("malloc error in new_block");
+	for (i = 0; i < BLOCK_CHUNK; i++) {
+	    b[i].next = free_blocks;
+	    free_blocks = &b[i];
+	}
     }
-    *ranges = NULL;
+    b = free_blocks;
+    free_blocks = b->next;
+    return b;
+}
+
+/*
+ * grow_blocks - Double the number of buckets of the table of live
+ *     blocks of a streamed trace
+ */
+static void grow_blocks(trace_t *trace)
+{
+    block_t **live, *b;
+    int bits = trace->live_bits + 1;
+    int i;
+
+    if ((live = (block_t **)calloc(1 << bits, sizeof(block_t *))) == NULL)
+	unix_error("calloc failed in grow_blocks");
+    for (i = 0; i < (1 << trace->live_bits); i++) {
+	while ((b = trace->live[i]) != NULL) {
+	    trace->live[i] = b->next;
+	    b->next = live[BLOCK_HASH(b->id, bits)];
+	    live[BLOCK_HASH(b->id, bits)] = b;
+	}
+    }
+    free(trace->live);
+    trace->live = live;
+    trace->live_bits = bits;
+}
+
+/*
+ * find_block - Return the record of block id of a streamed trace,
+ *     adding one if the block is not live
+ */
+static block_t *find_block(trace_t *trace, int id)
+{
+    block_t *b;
+    unsigned h = BLOCK_HASH(id, trace->live_bits);
+
+    for (b = trace->live[h]; b != NULL; b = b->next)
+	if (b->id == id)
+	    return b;
+    if (trace->num_live >= (1 << trace->live_bits) && trace->live_bits < 30) {
+	grow_blocks(trace);
+	h = BLOCK_HASH(id, trace->live_bits);
+    }
+    b = new_block();
+    b->id = id;
+    b->p = NULL;
+    b->size = 0;
+    b->next = trace->live[h];
+    trace->live[h] = b;
+    trace->num_live++;
+    return b;
+}
+
+/*
+ * drop_block - Remove block id of a streamed trace from the table of
+ *     live blocks once it has been freed
+ */
+static void drop_block(trace_t *trace, int id)
+{
+    block_t **link, *b;
+
+    for (link = &trace->live[BLOCK_HASH(id, trace->live_bits)];
+	    (b = *link) != NULL; link = &b->next) {
+	if (b->id == id) {
+	    *link = b->next;
+	    b->next = free_blocks;
+	    free_blocks = b;
+	    trace->num_live--;
+	    return;
+	}
+    }
+}
+
+/*
+ * clear_blocks - Return the records of all the live blocks of a
+ *     streamed trace to the pool
+ */
+static void clear_blocks(trace_t *trace)
+{
+    block_t *b;
+    int i;
+
+    if (trace->live == NULL)
+	return;
+    for (i = 0; i < (1 << trace->live_bits); i++) {
+	while ((b = trace->live[i]) != NULL) {
+	    trace->live[i] = b->next;
+	    b->next = free_blocks;
+	    free_blocks = b;
+	}
+    }
+    trace->num_live = 0;
+}
+
+/*
+ * block_slot - Return where the pointer to block id of the trace is
+ *     kept: in the array of blocks, or in the record of a live block of
+ *     a streamed trace, which is added if there is none
+ */
+static inline char **block_slot(trace_t *trace, int id)
+{
+    if (trace->live == NULL)
+	return &trace->blocks[id];
+    return &find_block(trace, id)->p;
 }
 
+/*
+ * size_slot - Return where the payload size of block id of the trace is
+ *     kept, like block_slot
+ */
+static inline size_t *size_slot(trace_t *trace, int id)
+{
+    if (trace->live == NULL)
+	return &trace->block_sizes[id];
+    return &find_block(trace, id)->size;
+}
+
+/*
+ * drop_slot - Forget block id of the trace once it has been freed
+ */
+static inline void drop_slot(trace_t *trace, int id)
+{
+    if (trace->live != NULL)
+	drop_block(trace, id);
+}
+
+/*
+ * batch_slots - Return an array of the pointers to blocks id ..
+ *     id+count-1 of the trace, for a batch request: the array of
+ *     blocks itself, or for a streamed trace a copy, which keep_batch
+ *     stores back once a batch malloc has filled it in
+ */
+static char **batch_slots(trace_t *trace, int id, int count)
+{
+    int j;
+
+    if (trace->live == NULL)
+	return &trace->blocks[id];
+    if (count > trace->batch_size) {
+	if ((trace->batch = (char **)realloc(trace->batch,
+					     count * sizeof(char *))) == NULL)
+	    unix_error("realloc failed in batch_slots");
+	trace->batch_size = count;
+    }
+    for (j = 0; j < count; j++)
+	trace->batch[j] = *block_slot(trace, id + j);
+    return trace->batch;
+}
+
+/*
+ * keep_batch - Store the pointers a batch malloc left in the array
+ *     batch_slots returned as those of blocks id .. id+count-1
+ */
+static void keep_batch(trace_t *trace, int id, int count)
+{
+    int j;
+
+    if (trace->live == NULL)
+	return;
+    for (j = 0; j < count; j++)
+	*block_slot(trace, id + j) = trace->batch[j];
+}
+
+
 
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * bogus_op - Return true if op is not a request this driver knows, or
+ *     uses a block id, size or thread number below 0
+ */
+static int bogus_op(traceop_t *op)
+{
+    return op->type < 0 || op->type >= NUM_OP_TYPES || op->type == REALLOC ||
+	OP_IDS(op) < 1 || op->index < 0 || op->index > INT_MAX - OP_IDS(op) ||
+	(op->type == CALLOC && op->nmemb < 1) || op->size < 0 || op->thread < 0;
+}
+
+/*
+ * map_trace - Map the .rbin trace file at path and point the trace's
+ *     ops at the records in the mapping, which are checked but neither
+ *     parsed nor copied.
+ */
+static void map_trace(char *path, trace_t *trace)
+{
+    int fd, i;
+    struct stat st;
+    rbin_header_t *header;
+    traceop_t *op;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if ((size_t)st.st_size < sizeof(rbin_header_t)) {
+	printf("Truncated .rbin tracefile %s\n", path);
+	exit(1);
+    }
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in read_trace");
+    close(fd);
+
+    header = (rbin_header_t *)trace->map;
+    if (header->magic != RBIN_MAGIC || header->version != RBIN_VERSION ||
+	header->num_ids < 0 || header->num_ops < 0 ||
+	trace->map_size != sizeof(rbin_header_t) + 
+	(size_t)header->num_ops * sizeof(traceop_t)) {
+	printf("Bogus .rbin header in tracefile %s\n", path);
+	exit(1);
+    }
+    trace->sugg_heapsize = header->sugg_heapsize; /* not used */
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = header->weight;               /* not used */
+    trace->ops = (traceop_t *)(header + 1);
+
+    /* Every record must be a request this driver knows, on ids the
+     * trace has */
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if (bogus_op(op) || op->index > trace->num_ids - OP_IDS(op)) {
+	    printf("Bogus request %d in tracefile %s\n", i, path);
+	    exit(1);
+	}
+    }
+
+    /* The arrays for the blocks are the only ones allocated */
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_trace");
+}
+
+/*
+ * bogus_line - Reject a request line whose fields are missing or
+ *     malformed
+ */
+static void bogus_line(char *path)
+{
+    printf("Bogus request line in tracefile %s\n", path);
+    exit(1);
+}
+
+/*
+ * read_op - Read the next request line of a .rep trace file into op,
+ *     or return 0 at the end of the file
+ */
+static int read_op(FILE *tracefile, traceop_t *op, char *path)
+{
+    char type[MAXLINE];
+    unsigned index, size, nmemb, count, align;
+
+    if (fscanf(tracefile, "%s", type) == EOF)
+	return 0;
+
+    op->size = 0; /* frees carry no size */
+
+    /* The request may be preceded by the thread that made it */
+    op->thread = 0;
+    if (isdigit((unsigned char)type[0])) {
+	op->thread = atoi(type);
+	if (fscanf(tracefile, "%s", type) != 1)
+	    bogus_line(path);
+    }
+    switch(type[0]) {
+    case 'a':
+	if (fscanf(tracefile, "%u %u", &index, &size) != 2)
+	    bogus_line(path);
+	op->type = ALLOC;
+	op->index = index;
+	op->size = size;
+	break;
+    case 'm':
+	/* m <id> <align> <size>: size bytes aligned to align */
+	if (fscanf(tracefile, "%u %u %u", &index, &align, &size) != 3)
+	    bogus_line(path);
+	op->type = ALIGNED_ALLOC;
+	op->index = index;
+	op->align = align;
+	op->size = size;
+	break;
+    case 'c':
+	/* c <id> <nmemb> <size>: size is the size of one element */
+	if (fscanf(tracefile, "%u %u %u", &index, &nmemb, &size) != 3 ||
+	    nmemb == 0)
+	    bogus_line(path);
+	if (size > INT_MAX / nmemb) {
+	    printf("Bogus calloc size (%u * %u) in tracefile %s\n",
+		   nmemb, size, path);
+	    exit(1);
+	}
+	op->type = CALLOC;
+	op->index = index;
+	op->size = nmemb * size;
+	op->nmemb = nmemb;
+	break;
+    case 'f':
+	if (fscanf(tracefile, "%ud", &index) != 1)
+	    bogus_line(path);
+	op->type = FREE;
+	op->index = index;
+	break;
+    case 's':
+	/* s <id> <size>: free knowing the size it was allocated for */
+	if (fscanf(tracefile, "%u %u", &index, &size) != 2)
+	    bogus_line(path);
+	op->type = FREE_SIZED;
+	op->index = index;
+	op->size = size;
+	break;
+    case 'A':
+	/* A <id> <count> <size>: ids id .. id+count-1 in one batch */
+	if (fscanf(tracefile, "%u %u %u", &index, &count, &size) != 3 ||
+	    count == 0)
+	    bogus_line(path);
+	op->type = ALLOC_BATCH;
+	op->index = index;
+	op->count = count;
+	op->size = size;
+	break;
+    case 'F':
+	/* F <id> <count>: free ids id .. id+count-1 in one batch */
+	if (fscanf(tracefile, "%u %u", &index, &count) != 2)
+	    bogus_line(path);
+	op->type = FREE_BATCH;
+	op->index = index;
+	op->count = count;
+	break;
+    default:
+	printf("Bogus type character (%c) in tracefile %s\n", 
+		type[0], path);
+	exit(1);
+    }
+    return 1;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory; a .rbin file
+ *     is mapped rather than read
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
     FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
+    int max_index = 0;
+    long op_index;
+    size_t len;
+    traceop_t *op;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
 
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+    /* Allocate the trace record; its requests are all in one chunk */
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* A .rbin trace is replayed from a mapping of the file */
     strcpy(path, tracedir);
     strcat(path, filename);
+    len = strlen(path);
+    if (len > 5 && strcmp(path + len - 5, ".rbin") == 0) {
+	map_trace(path, trace);
+	trace->chunk_end = trace->num_ops;
+	return trace;
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	//sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (fscanf(tracefile, "%d %d %ld %d", &trace->sugg_heapsize,
+	       &trace->num_ids, &trace->num_ops, &trace->weight) != 4) {
+	printf("Bogus header in tracefile %s\n", path);
+	exit(1);
+    }
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
@@ -489,46 +1490,190 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	unix_error("malloc 4 failed in read_trace");
     
     /* read every request line in the trace file */
-    index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
+    while (op_index < trace->num_ops &&
+	    read_op(tracefile, &trace->ops[op_index], path)) {
+	op = &trace->ops[op_index];
+	if (op->index + OP_IDS(op) - 1 > max_index)
+	    max_index = op->index + OP_IDS(op) - 1;
 	op_index++;
-	
     }
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
-    
+    trace->chunk_end = trace->num_ops;
+
+    return trace;
+}
+
+/*
+ * stream_trace - Open the trace file filename, or stdin if it is "-",
+ *     to be read STREAM_CHUNK requests at a time as it is replayed, so
+ *     that a trace of any length needs only one chunk of requests and
+ *     its live blocks in memory.  The file may be a .rep or a .rbin
+ *     trace.  Each evaluation replays the trace from its first request:
+ *     a file that cannot seek, such as a pipe, is read once, and its
+ *     requests are copied to a temporary file to be replayed from.  The
+ *     time of a replay includes reading the trace, which costs little
+ *     for a .rbin trace, and finding its blocks by id.
+ */
+static trace_t *stream_trace(char *filename)
+{
+    trace_t *trace;
+    rbin_header_t header;
+    int c;
+
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", filename);
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
+	unix_error("malloc 1 failed in stream_trace");
+    trace->stream_name = filename;
+    if (strcmp(filename, "-") == 0)
+	trace->stream = stdin;
+    else if ((trace->stream = fopen(filename, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in stream_trace", filename);
+	unix_error(msg);
+    }
+
+    /* 
+     * Read the header.  A .rbin file starts with its magic number, a 
+     * .rep file with a digit.  The number of requests is not needed
+     * (a capture that is still running may not know it), nor is
+     * num_ids, since the blocks are kept by id as they become live.
+     */
+    c = getc(trace->stream);
+    ungetc(c, trace->stream);
+    trace->stream_rbin = (c != EOF && !isdigit(c) && !isspace(c));
+    if (trace->stream_rbin) {
+	if (fread(&header, sizeof(header), 1, trace->stream) != 1 ||
+		header.magic != RBIN_MAGIC || header.version != RBIN_VERSION) {
+	    printf("Bogus .rbin header in tracefile %s\n", filename);
+	    exit(1);
+	}
+	trace->sugg_heapsize = header.sugg_heapsize; /* not used */
+	trace->num_ids = header.num_ids;
+	trace->weight = header.weight;               /* not used */
+    } else if (fscanf(trace->stream, "%d %d %*d %d", &trace->sugg_heapsize,
+		&trace->num_ids, &trace->weight) != 3) {
+	printf("Bogus header in tracefile %s\n", filename);
+	exit(1);
+    }
+    if ((trace->stream_start = ftell(trace->stream)) < 0 ||
+	    fseek(trace->stream, trace->stream_start, SEEK_SET) < 0) {
+	if ((trace->spool = tmpfile()) == NULL)
+	    unix_error("tmpfile failed in stream_trace");
+    }
+
+    /* Room for one chunk of requests and the table of live blocks */
+    if ((trace->ops = 
+	 (traceop_t *)malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+	unix_error("malloc 2 failed in stream_trace");
+    trace->live_bits = LIVE_BITS;
+    if ((trace->live =
+	 (block_t **)calloc(1 << LIVE_BITS, sizeof(block_t *))) == NULL)
+	unix_error("calloc failed in stream_trace");
     return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * read_chunk - Read the next chunk of requests of a streamed trace, and
+ *     add them to the copy of a stream that cannot seek.  Return the
+ *     first request of the chunk, or NULL at the end of the trace, when
+ *     the number of requests in the trace becomes known.
+ */
+static traceop_t *read_chunk(trace_t *trace)
+{
+    int n, i;
+
+    if (trace->stream_rbin)
+	n = fread(trace->ops, sizeof(traceop_t), STREAM_CHUNK, trace->stream);
+    else
+	for (n = 0; n < STREAM_CHUNK &&
+		read_op(trace->stream, &trace->ops[n], trace->stream_name); n++)
+	    ;
+    trace->chunk_base = trace->chunk_end;
+    trace->chunk_end += n;
+    if (n == 0) {
+	trace->num_ops = trace->chunk_base;
+	return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+	if (bogus_op(&trace->ops[i])) {
+	    printf("Bogus request %ld in tracefile %s\n",
+		    trace->chunk_base + i, trace->stream_name);
+	    exit(1);
+	}
+    }
+    if (trace->spool != NULL &&
+	    fwrite(trace->ops, sizeof(traceop_t), n, trace->spool) != (size_t)n)
+	unix_error("fwrite failed in read_chunk");
+    return trace->ops;
+}
+
+/*
+ * rewind_trace - Go back to the first request of the trace, with no
+ *     blocks live, before replaying it.  Once a stream that cannot seek
+ *     has been read (to its end, if the last replay stopped early), it
+ *     is replaced by the copy of its requests.
+ */
+static void rewind_trace(trace_t *trace)
+{
+    if (trace->stream == NULL)
+	return;
+    if (trace->spool != NULL && trace->chunk_end > 0) {
+	while (read_chunk(trace) != NULL)
+	    ;
+	if (trace->stream != stdin)
+	    fclose(trace->stream);
+	trace->stream = trace->spool;
+	trace->spool = NULL;
+	trace->stream_rbin = 1;
+	trace->stream_start = 0;
+    }
+    if (trace->spool == NULL &&
+	    fseek(trace->stream, trace->stream_start, SEEK_SET) < 0)
+	unix_error("fseek failed in rewind_trace");
+    trace->chunk_base = trace->chunk_end = 0;
+    clear_blocks(trace);
+}
+
+/*
+ * trace_op - Return request i of the trace, or NULL past its last one.
+ *     The eval functions ask for the requests in order from 0 on, after
+ *     rewind_trace.
+ */
+static inline traceop_t *trace_op(trace_t *trace, long i)
+{
+    if (i < trace->chunk_end)
+	return &trace->ops[i - trace->chunk_base];
+    return (trace->stream != NULL) ? read_chunk(trace) : NULL;
+}
+
+/*
+ * free_trace - Free the trace record and the arrays it points to, all
+ *              of which were allocated in read_trace() or
+ *              stream_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* the ops live in the mapping... */
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);     /* ... or free the arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    if (trace->live != NULL) {
+	clear_blocks(trace);
+	free(trace->live);
+	free(trace->batch);
+    }
+    if (trace->stream != NULL && trace->stream != stdin)
+	fclose(trace->stream);
+    if (trace->spool != NULL)
+	fclose(trace->spool);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -542,10 +1687,14 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i;
+    long i;
+    traceop_t *op;
+    int j;
+    int count;
     int index;
     int size;
     char *p;
+    char **batch;
     int show = 1;
     
     /* Reset the heap and free any records in the range list */
@@ -559,10 +1708,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
-    // printf("\ntrace->ops[i].type %d\n",trace->ops[i].type);
+    rewind_trace(trace);
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+	index = op->index;
+	size = op->size;
+    // printf("\nop->type %d\n",op->type);
     // printf("index = %d\n",index);
     // printf("size = %d\n",size);
     show = 0;
@@ -576,7 +1726,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     // }
     
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -592,8 +1742,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     * to the range list if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
 		return 0;
+
+	    /* The block may hold no less than was asked for */
+	    if (mm_malloc_usable_size(p) < size) {
+		malloc_error(tracenum, i, "mm_malloc_usable_size is below the request");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -603,18 +1759,113 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    memset(p, index & 0xFF, size);
 
 	    /* Remember region */
-	    trace->blocks[index] = p;
-	    trace->block_sizes[index] = size;
+	    *block_slot(trace, index) = p;
+	    *size_slot(trace, index) = size;
+	    break;
+
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+
+	    /* Call the student's aligned alloc */
+	    if ((p = mm_aligned_alloc(op->align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_aligned_alloc failed.");
+		return 0;
+	    }
+
+	    /* Check the range like a malloc'd block's, at the alignment asked for */
+	    if (add_range(ranges, p, size, op->align, tracenum, i) == 0)
+		return 0;
+	    if (mm_malloc_usable_size(p) < size) {
+		malloc_error(tracenum, i, "mm_malloc_usable_size is below the request");
+		return 0;
+	    }
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    *block_slot(trace, index) = p;
+	    *size_slot(trace, index) = size;
+	    break;
+
+        case CALLOC: /* mm_calloc */
+
+	    /* Call the student's calloc */
+	    if ((p = mm_calloc(op->nmemb, size / op->nmemb)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+
+	    /* Check the range like a malloc'd block's */
+	    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
+		return 0;
+
+	    /* The block must come zeroed */
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not zero the block");
+		    return 0;
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    *block_slot(trace, index) = p;
+	    *size_slot(trace, index) = size;
 	    break;
 
         case FREE: /* mm_free */
 	    
 	    /* Remove region from list and call student's free function */
-	    p = trace->blocks[index];
+	    p = *block_slot(trace, index);
 	    remove_range(ranges, p);
+	    drop_slot(trace, index);
 	    mm_free(p);
 	    break;
 
+        case FREE_SIZED: /* mm_free_sized */
+
+	    /* The trace must know the size the block has */
+	    if (size != *size_slot(trace, index)) {
+		malloc_error(tracenum, i, "sized free of the wrong size in the trace");
+		return 0;
+	    }
+	    p = *block_slot(trace, index);
+	    remove_range(ranges, p);
+	    drop_slot(trace, index);
+	    mm_free_sized(p, size);
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* Call the student's batch malloc; the ids are consecutive */
+	    count = op->count;
+	    batch = batch_slots(trace, index, count);
+	    if (mm_malloc_batch(size, count, (void **)batch) != count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    keep_batch(trace, index, count);
+
+	    /* Check and fill every block like a malloc'd one */
+	    for (j = 0; j < count; j++) {
+		p = batch[j];
+		if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index + j) & 0xFF, size);
+		*size_slot(trace, index + j) = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+
+	    /* Remove the regions from the list, then free them at once */
+	    count = op->count;
+	    batch = batch_slots(trace, index, count);
+	    for (j = 0; j < count; j++) {
+		remove_range(ranges, batch[j]);
+		drop_slot(trace, index + j);
+	    }
+	    mm_free_batch((void **)batch, count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -631,39 +1882,52 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size the heap reached while running the student's malloc 
+ *   package on the trace.  The package may give memory back with
+ *   mem_trim(), so the final brk need not be the high water mark of
+ *   the heap. 
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    int i;
+    long i;
+    traceop_t *op;
+    int j;
+    int count;
     int index;
     int size;
-    int max_total_size = 0;
-    int total_size = 0;
+    long max_total_size = 0;
+    long total_size = 0;
     char *p;
+    char **batch;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-
-	    if ((p = mm_malloc(size)) == NULL) 
+        case CALLOC: /* mm_calloc */
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+	    index = op->index;
+	    size = op->size;
+
+	    if (op->type == CALLOC)
+		p = mm_calloc(op->nmemb, size / op->nmemb);
+	    else if (op->type == ALIGNED_ALLOC)
+		p = mm_aligned_alloc(op->align, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
-	    trace->blocks[index] = p;
-	    trace->block_sizes[index] = size;
+	    *block_slot(trace, index) = p;
+	    *size_slot(trace, index) = size;
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -675,9 +1939,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
-	    size = trace->block_sizes[index];
-	    p = trace->blocks[index];
+	    index = op->index;
+	    size = *size_slot(trace, index);
+	    p = *block_slot(trace, index);
+	    drop_slot(trace, index);
 	    
 	    mm_free(p);
 	    
@@ -687,13 +1952,50 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case FREE_SIZED: /* mm_free_sized */
+	    index = op->index;
+	    size = *size_slot(trace, index);
+	    p = *block_slot(trace, index);
+	    drop_slot(trace, index);
+	    mm_free_sized(p, size);
+	    total_size -= size;
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = op->index;
+	    size = op->size;
+	    count = op->count;
+
+	    if (mm_malloc_batch(size, count,
+				(void **)batch_slots(trace, index, count)) != count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    keep_batch(trace, index, count);
+	    for (j = 0; j < count; j++)
+		*size_slot(trace, index + j) = size;
+
+	    total_size += count * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    index = op->index;
+	    count = op->count;
+	    batch = batch_slots(trace, index, count);
+	    for (j = 0; j < count; j++) {
+		total_size -= *size_slot(trace, index + j);
+		drop_slot(trace, index + j);
+	    }
+	    mm_free_batch((void **)batch, count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -703,8 +2005,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size;
+    long i;
+    traceop_t *op;
+    int j;
+    int index, size;
     char *p, *block;
+    char **batch;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
@@ -713,23 +2019,65 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++)
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+            *block_slot(trace, index) = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = op->index;
+            size = op->size;
+            if ((p = mm_calloc(op->nmemb, size / op->nmemb)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            *block_slot(trace, index) = p;
+            break;
+
+        case ALIGNED_ALLOC: /* mm_aligned_alloc */
+            index = op->index;
+            size = op->size;
+            if ((p = mm_aligned_alloc(op->align, size)) == NULL)
+		app_error("mm_aligned_alloc error in eval_mm_speed");
+            *block_slot(trace, index) = p;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
+            index = op->index;
+            block = *block_slot(trace, index);
+            drop_slot(trace, index);
             mm_free(block);
             break;
 
+        case FREE_SIZED: /* mm_free_sized */
+            index = op->index;
+            block = *block_slot(trace, index);
+            drop_slot(trace, index);
+            mm_free_sized(block, op->size);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = op->index;
+            size = op->size;
+            if (mm_malloc_batch(size, op->count,
+				(void **)batch_slots(trace, index, op->count)) == 0)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            keep_batch(trace, index, op->count);
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = op->index;
+            batch = batch_slots(trace, index, op->count);
+            for (j = 0; j < op->count; j++)
+		drop_slot(trace, index + j);
+            mm_free_batch((void **)batch, op->count);
+            break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -743,23 +2091,62 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i;
+    long i;
+    traceop_t *op;
+    int j;
     char *p;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    *block_slot(trace, op->index) = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    if ((p = calloc(op->nmemb, op->size / op->nmemb)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    *block_slot(trace, op->index) = p;
+	    break;
+
+        case ALIGNED_ALLOC: /* aligned_alloc */
+	    if ((p = aligned_alloc(op->align, op->size)) == NULL) {
+		malloc_error(tracenum, i, "libc aligned_alloc failed");
+		unix_error("System message");
+	    }
+	    *block_slot(trace, op->index) = p;
 	    break;
 
         case FREE: /* free */
-           free(trace->blocks[trace->ops[i].index]);
+        case FREE_SIZED: /* libc has no sized free */
+           free(*block_slot(trace, op->index));
+           drop_slot(trace, op->index);
            break;	
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    for (j = 0; j < op->count; j++) {
+		if ((p = malloc(op->size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		*block_slot(trace, op->index + j) = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    for (j = 0; j < op->count; j++) {
+		free(*block_slot(trace, op->index + j));
+		drop_slot(trace, op->index + j);
+	    }
+	    break;
+
 		default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -775,26 +2162,65 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    long i;
+    traceop_t *op;
+    int j;
     int index, size;
     char *p, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    rewind_trace(trace);
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
-	    trace->blocks[index] = p;
+	    *block_slot(trace, index) = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    index = op->index;
+	    size = op->size;
+	    if ((p = calloc(op->nmemb, size / op->nmemb)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    *block_slot(trace, index) = p;
+	    break;
+
+        case ALIGNED_ALLOC: /* aligned_alloc */
+	    index = op->index;
+	    size = op->size;
+	    if ((p = aligned_alloc(op->align, size)) == NULL)
+		unix_error("aligned_alloc failed in eval_libc_speed");
+	    *block_slot(trace, index) = p;
 	    break;
 
         case FREE: /* free */
-	    index = trace->ops[i].index;
-	    block = trace->blocks[index];
+        case FREE_SIZED: /* libc has no sized free */
+	    index = op->index;
+	    block = *block_slot(trace, index);
+	    drop_slot(trace, index);
 	    free(block);
 	    break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    index = op->index;
+	    size = op->size;
+	    for (j = 0; j < op->count; j++) {
+		if ((p = malloc(size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+		*block_slot(trace, index + j) = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    index = op->index;
+	    for (j = 0; j < op->count; j++) {
+		free(*block_slot(trace, index + j));
+		drop_slot(trace, index + j);
+	    }
+	    break;
 	}
     }
 }
@@ -882,10 +2308,10 @@ void unix_error(char *msg)
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-void malloc_error(int tracenum, int opnum, char *msg)
+void malloc_error(int tracenum, long opnum, char *msg)
 {
     errors++;
-    printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+    printf("ERROR [trace %d, line %ld]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
 /* 
@@ -893,13 +2319,17 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValp] [-f <file>] [-s <file>] [-t <dir>] [-j <n>] [-T <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate the traces in up to <n> worker processes at once.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-p         Pin the worker processes to separate CPUs.\n");
+    fprintf(stderr, "\t-s <file>  Stream <file> (- for stdin, not with -l) as the trace file.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay the traces on 1 to <n> threads at once.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,158 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The heap lives in one range of virtual memory reserved (PROT_NONE) by
+ * mem_init.  mem_sbrk commits pages in MEM_COMMIT_STEP steps as the brk
+ * advances past them; mem_trim decommits the pages past the new brk.
+ * Pages read as zero until the brk first advances over them, and again
+ * once they are decommitted; mem_reset_brk keeps them committed, so a
+ * heap built after it starts out over the old heap's bytes.
+ */
+#define MEM_COMMIT_STEP (64 * 1024)
+
+/* Reserve tried when the caller does not choose one: 4 GB on 64-bit
+   hosts, where it costs nothing but address space. */
+#define MEM_RESERVE_DEFAULT (sizeof(void *) >= 8 ? ((size_t)4 << 30) : ((size_t)256 << 20))
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit_end; /* end of the committed (read/write) pages */
+static char *mem_clean;      /* every byte from here on reads as zero */
+static size_t mem_peak_size; /* largest heap size since the last reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mem_brk */
+
+/*
+ * Besides the heap, the allocator may get mappings of its own (see
+ * mem_map).  They count towards the heap size for mem_peak_heapsize.
+ */
+typedef struct {
+  char *start;
+  size_t length;
+} mapping_t;
+
+static mapping_t *mem_maps;     /* live mappings, sorted by start */
+static size_t mem_nmaps;        /* number of live mappings */
+static size_t mem_maps_room;    /* number of entries mem_maps has room for */
+static size_t mem_mapped;       /* total length of the live mappings */
+
+/* Account for a change of the heap size; caller holds mem_lock. */
+static void mem_note_size(void)
+{
+  size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+  if (size > mem_peak_size)
+    mem_peak_size = size;
+}
+
+/* Return the number of mappings that start at or below addr, found by
+   binary search; caller holds mem_lock. */
+static size_t mem_maps_below(char *addr)
+{
+  size_t lo = 0, hi = mem_nmaps, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (mem_maps[mid].start <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Return the entry of the mapping starting at start; caller holds
+   mem_lock. */
+static mapping_t *mem_find_map(char *start)
+{
+  size_t i = mem_maps_below(start);
+
+  if (i > 0 && mem_maps[i - 1].start == start)
+    return &mem_maps[i - 1];
+  return NULL;
+}
+
+/* Add the mapping of length bytes at start in its place in mem_maps,
+   which must have room for it; caller holds mem_lock. */
+static void mem_add_map(char *start, size_t length)
+{
+  size_t i = mem_maps_below(start);
+
+  memmove(&mem_maps[i + 1], &mem_maps[i], (mem_nmaps - i) * sizeof(mapping_t));
+  mem_maps[i].start = start;
+  mem_maps[i].length = length;
+  mem_nmaps++;
+}
+
+/* Drop the entry map from mem_maps; caller holds mem_lock. */
+static void mem_drop_map(mapping_t *map)
+{
+  mem_nmaps--;
+  memmove(map, map + 1, (&mem_maps[mem_nmaps] - map) * sizeof(mapping_t));
+}
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init_reserve - initialize the memory system model with a heap of
+ *    up to reserve bytes.  If that much address space cannot be had,
+ *    half as much is tried, down to MAX_HEAP.  The heap and mappings of
+ *    an earlier call are given back first.
  */
-void mem_init(void)
+void mem_init_reserve(size_t reserve)
 {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
+  void *p = MAP_FAILED;
+
+  if (mem_start_brk != NULL) {
+    mem_reset_brk();
+    mem_deinit();
+  }
+  reserve = (reserve + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  for (;;) {
+    p = mmap(NULL, reserve, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED || reserve / 2 < MAX_HEAP)
+      break;
+    reserve /= 2;
+  }
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "mem_init_reserve: mmap error\n");
     exit(1);
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+  mem_start_brk = (char *)p;
+  mem_max_addr = mem_start_brk + reserve;   /* max legal heap address */
   mem_brk = mem_start_brk;                  /* heap is empty initially */
+  mem_commit_end = mem_start_brk;
+  mem_clean = mem_start_brk;
+  mem_peak_size = 0;
+}
+
+/* 
+ * mem_init - initialize the memory system model.  The heap may grow up
+ *    to MEMLIB_RESERVE bytes if that is set in the environment (with an
+ *    optional K, M or G suffix), or else MEM_RESERVE_DEFAULT.
+ */
+void mem_init(void)
+{
+  const char *env = getenv("MEMLIB_RESERVE");
+  size_t reserve = MEM_RESERVE_DEFAULT;
+  char *end;
+
+  if (env != NULL && *env != '\0') {
+    reserve = strtoull(env, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': reserve <<= 10; /* fall through */
+    case 'M': case 'm': reserve <<= 10; /* fall through */
+    case 'K': case 'k': reserve <<= 10;
+    }
+  }
+  mem_init_reserve(reserve);
 }
 
 /* 
@@ -39,35 +170,204 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-  free(mem_start_brk);
+  munmap(mem_start_brk, mem_max_addr - mem_start_brk);
+  mem_start_brk = NULL;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer and drop all mappings
+ *    to make an empty heap
  */
 void mem_reset_brk()
 {
+  while (mem_nmaps > 0) {
+    mem_nmaps--;
+    munmap(mem_maps[mem_nmaps].start, mem_maps[mem_nmaps].length);
+  }
+  mem_mapped = 0;
   mem_brk = mem_start_brk;
+  mem_peak_size = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.  The
+ *    heap is shrunk with mem_trim.  Safe to call from several threads
+ *    at once.
  */
 void *mem_sbrk(size_t incr) 
 {
-  char *old_brk = mem_brk;
+  char *old_brk;
 
+  pthread_mutex_lock(&mem_lock);
+  old_brk = mem_brk;
   if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    pthread_mutex_unlock(&mem_lock);
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
   }
+  if (mem_brk + incr > mem_commit_end) {
+    /* commit pages up to the next step past the new brk */
+    size_t commit = ((size_t)(mem_brk + incr - mem_start_brk) + MEM_COMMIT_STEP - 1)
+      & ~(size_t)(MEM_COMMIT_STEP - 1);
+    char *commit_end = mem_start_brk + commit < mem_max_addr ? mem_start_brk + commit : mem_max_addr;
+
+    if (mprotect(mem_commit_end, commit_end - mem_commit_end,
+                 PROT_READ | PROT_WRITE) != 0) {
+      pthread_mutex_unlock(&mem_lock);
+      errno = ENOMEM;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+      return (void *)-1;
+    }
+    mem_commit_end = commit_end;
+  }
   mem_brk += incr;
+  if (mem_brk > mem_clean)
+    mem_clean = mem_brk;
+  mem_note_size();
+  pthread_mutex_unlock(&mem_lock);
   return (void *)old_brk;
 }
 
+/*
+ * mem_map - gets a mapping of length bytes (a multiple of the page
+ *    size) of its own, outside the heap.  Returns its page-aligned
+ *    start, or NULL if it cannot.  Safe to call from several threads
+ *    at once, as are mem_unmap and mem_remap.
+ */
+void *mem_map(size_t length)
+{
+  mapping_t *maps;
+  char *start;
+
+  start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED)
+    return NULL;
+  pthread_mutex_lock(&mem_lock);
+  if (mem_nmaps == mem_maps_room) {
+    maps = realloc(mem_maps, (mem_maps_room ? 2 * mem_maps_room : 16) * sizeof(mapping_t));
+    if (maps == NULL) {
+      pthread_mutex_unlock(&mem_lock);
+      munmap(start, length);
+      return NULL;
+    }
+    mem_maps = maps;
+    mem_maps_room = mem_maps_room ? 2 * mem_maps_room : 16;
+  }
+  mem_add_map(start, length);
+  mem_mapped += length;
+  mem_note_size();
+  pthread_mutex_unlock(&mem_lock);
+  return start;
+}
+
+/*
+ * mem_unmap - gives back the mapping of length bytes at start, which
+ *    mem_map or mem_remap returned
+ */
+void mem_unmap(void *start, size_t length)
+{
+  mapping_t *map;
+
+  pthread_mutex_lock(&mem_lock);
+  if ((map = mem_find_map(start)) != NULL) {
+    mem_drop_map(map);
+    mem_mapped -= length;
+  }
+  pthread_mutex_unlock(&mem_lock);
+  munmap(start, length);
+}
+
+/*
+ * mem_remap - resizes the mapping of old_length bytes at start to
+ *    new_length bytes (a multiple of the page size), moving it if need
+ *    be; its contents are kept without being copied.  Returns its new
+ *    start, or NULL (and leaves it as it was) if it cannot.
+ */
+void *mem_remap(void *start, size_t old_length, size_t new_length)
+{
+  mapping_t *map;
+  char *new_start;
+
+  new_start = mremap(start, old_length, new_length, MREMAP_MAYMOVE);
+  if (new_start == MAP_FAILED)
+    return NULL;
+  pthread_mutex_lock(&mem_lock);
+  if ((map = mem_find_map(start)) != NULL) {
+    /* a moved mapping takes a new place in the order */
+    mem_drop_map(map);
+    mem_add_map(new_start, new_length);
+    mem_mapped += new_length - old_length;
+    mem_note_size();
+  }
+  pthread_mutex_unlock(&mem_lock);
+  return new_start;
+}
+
+/*
+ * mem_contains - returns 1 if the bytes lo to hi all lie in the heap or
+ *    all lie in one mapping, and 0 otherwise
+ */
+int mem_contains(void *lo, void *hi)
+{
+  size_t i;
+  int found = 0;
+
+  if ((char *)lo >= mem_start_brk && (char *)hi < mem_brk)
+    return 1;
+  pthread_mutex_lock(&mem_lock);
+  /* only the last mapping to start at or below lo can hold it */
+  if ((i = mem_maps_below((char *)lo)) > 0)
+    found = (char *)hi < mem_maps[i - 1].start + mem_maps[i - 1].length;
+  pthread_mutex_unlock(&mem_lock);
+  return found;
+}
+
+/*
+ * mem_trim - shrinks the heap by decr bytes and decommits the whole
+ *    pages past the new brk, giving them back to the system.  Returns
+ *    0, or -1 if the heap is smaller than decr.  Safe to call from
+ *    several threads at once.
+ */
+int mem_trim(size_t decr)
+{
+  size_t pagesize = mem_pagesize();
+  char *lo;
+
+  pthread_mutex_lock(&mem_lock);
+  if (decr > (size_t)(mem_brk - mem_start_brk)) {
+    pthread_mutex_unlock(&mem_lock);
+    return -1;
+  }
+  mem_brk -= decr;
+  lo = mem_start_brk + (((size_t)(mem_brk - mem_start_brk) + pagesize - 1) & ~(pagesize - 1));
+  if (lo < mem_commit_end) {
+    madvise(lo, mem_commit_end - lo, MADV_DONTNEED);
+    mprotect(lo, mem_commit_end - lo, PROT_NONE);
+    mem_commit_end = lo;
+  }
+  if (lo < mem_clean)
+    mem_clean = lo;
+  pthread_mutex_unlock(&mem_lock);
+  return 0;
+}
+
+/*
+ * mem_clean_lo - return the lowest address from which on every byte of
+ *    the heap range reads as zero until the brk next advances over it
+ */
+void *mem_clean_lo()
+{
+  char *clean;
+
+  pthread_mutex_lock(&mem_lock);
+  clean = mem_clean;
+  pthread_mutex_unlock(&mem_lock);
+  return (void *)clean;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +392,15 @@ size_t mem_heapsize()
   return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes,
+ *    mappings included, since the heap was last reset
+ */
+size_t mem_peak_heapsize() 
+{
+  return mem_peak_size;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,19 @@
 #include <unistd.h>
 
 void mem_init(void);               
+void mem_init_reserve(size_t reserve);
 void mem_deinit(void);
 void *mem_sbrk(size_t incr);
+int mem_trim(size_t decr);
+void *mem_map(size_t length);
+void mem_unmap(void *start, size_t length);
+void *mem_remap(void *start, size_t old_length, size_t new_length);
+int mem_contains(void *lo, void *hi);
 void mem_reset_brk(void); 
+void *mem_clean_lo(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
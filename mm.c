@@ -1,6 +1,7 @@
 /*-------------------------------------------------------------------
  *  UW CSE 351 Summer 2013 Lab 5 Starter code: 
- *        single doubly-linked free block list with LIFO policy
+ *        segregated doubly-linked free block lists (one per size
+ *        class) with LIFO policy
  *        with support for coalescing adjacent free blocks
  *
  * Terminology:
@@ -16,6 +17,10 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "memlib.h"
 #include "mm.h"
@@ -33,6 +38,21 @@
 #define UNSCALED_POINTER_ADD(p,x) ((void*)((char*)(p) + (x)))
 #define UNSCALED_POINTER_SUB(p,x) ((void*)((char*)(p) - (x)))
 
+/* Alignment of blocks returned by mm_malloc: 8 bytes, or 16 (what the
+   x86-64 ABI expects of malloc) when built with -DALIGNMENT=16.
+   mm_aligned_alloc gives stricter alignments per request. */
+#ifndef ALIGNMENT
+#define ALIGNMENT 8
+#endif
+
+#if ALIGNMENT == 8
+#define ALIGNMENT_LOG2 3
+#elif ALIGNMENT == 16
+#define ALIGNMENT_LOG2 4
+#else
+#error "ALIGNMENT must be 8 or 16"
+#endif
+
 
 /******** FREE LIST IMPLEMENTATION ***********************************/
 
@@ -63,38 +83,230 @@
    |  (footer)    |
    +--------------+
 */
+/* Block metadata comes in two widths, selected at build time:
+
+   By default a header/boundary tag (a Tag) is a full word and the free
+   list links are plain pointers.
+
+   With -DMM_COMPACT, headers and boundary tags are 4 bytes and the
+   links are stored as 32-bit offsets from the start of the heap (0
+   meaning NULL), which halves the overhead of small blocks: the
+   minimum block shrinks from 32 to 16 bytes.  This limits the heap,
+   and so every block, to 4 GB. */
+#ifdef MM_COMPACT
+typedef uint32_t Tag;
+typedef uint32_t LinkWord;
+#define LINK_PTR(link) ((link) ? (void *)(heapBase + (link)) : NULL)
+#define PTR_LINK(ptr) ((ptr) ? (LinkWord)((char *)(ptr) - heapBase) : 0)
+#else
+typedef size_t Tag;
+typedef uintptr_t LinkWord;
+#define LINK_PTR(link) ((void *)(link))
+#define PTR_LINK(ptr) ((LinkWord)(ptr))
+#endif
+
+/* First byte of the heap, which compact links are relative to. */
+static char *heapBase;
+
 struct BlockInfo {
   // Size of the block (in the high bits) and tags for whether the
   // block and its predecessor in memory are in use.  See the SIZE()
   // and TAG macros, below, for more details.
-  size_t sizeAndTags;
-  // Pointer to the next block in the free list.
-  struct BlockInfo* next;
-  // Pointer to the previous block in the free list.
-  struct BlockInfo* prev;
+  Tag sizeAndTags;
+  // Link to the next block in the free list.
+  LinkWord next;
+  // Link to the previous block in the free list.
+  LinkWord prev;
 };
 typedef struct BlockInfo BlockInfo;
 
-
-/* Pointer to the first BlockInfo in the free list, the list's head. 
+/* Follow or set the free list links of a block. */
+#define NEXT_FREE(block) ((BlockInfo *)LINK_PTR((block)->next))
+#define PREV_FREE(block) ((BlockInfo *)LINK_PTR((block)->prev))
+#define SET_NEXT_FREE(block, ptr) ((block)->next = PTR_LINK(ptr))
+#define SET_PREV_FREE(block, ptr) ((block)->prev = PTR_LINK(ptr))
+
+/* The free blocks are indexed by one of the following structures,
+   selected at build time with -DFREE_INDEX=...:
+
+   FREE_INDEX_SEGLIST: segregated LIFO lists, one per power-of-two size
+     class, searched first-fit within the class of the request.
+   FREE_INDEX_TLSF: two-level segregated fit (TLSF).  A first-level
+     bitmap over power-of-two ranges and a second-level bitmap over
+     linear subdivisions of each range find a suitable block with
+     two find-first-set operations, so malloc and free run in constant
+     time no matter how many blocks are free.
+   FREE_INDEX_TREE: exact best fit.  Free blocks are kept in a red-black
+     tree ordered by size, with blocks of equal size chained off a
+     single tree node, so a best-fit lookup takes O(log n).  Blocks too
+     small to hold the tree links are kept in exact-size lists. */
+#define FREE_INDEX_SEGLIST 0
+#define FREE_INDEX_TLSF    1
+#define FREE_INDEX_TREE    2
+
+#ifndef FREE_INDEX
+#define FREE_INDEX FREE_INDEX_TLSF
+#endif
+
+#if FREE_INDEX == FREE_INDEX_SEGLIST
+
+/* Pointer to the first BlockInfo in the free list of size class
+   'class', the list's head.
    
-   A pointer to the head of the free list in this implementation is
-   always stored in the first word in the heap.  mem_heap_lo() returns
-   a pointer to the first word in the heap, so we cast the result of
-   mem_heap_lo() to a BlockInfo** (a pointer to a pointer to
-   BlockInfo) and dereference this to get a pointer to the first
-   BlockInfo in the free list. */
-#define FREE_LIST_HEAD *((BlockInfo **)mem_heap_lo())
+   The heads of the segregated free lists in this implementation are
+   always stored in the first NUM_SIZE_CLASSES words of the current
+   arena's first segment (its prologue; see ARENAS below).  We cast the
+   start of the prologue to a BlockInfo** (an array of pointers to
+   BlockInfo) and index it to get a pointer to the first BlockInfo in
+   the free list of that class. */
+#define FREE_LIST_HEAD(class) (((BlockInfo **)curArena->prologue)[class])
+
+/* Number of segregated free lists.  Class 0 holds blocks of exactly
+   MIN_BLOCK_SIZE bytes, class c (c > 0) holds blocks whose size is in
+   (MIN_BLOCK_SIZE << (c-1), MIN_BLOCK_SIZE << c], and the last class
+   holds every block larger than that. */
+#define NUM_SIZE_CLASSES 16
+
+/* Size of the part of the heap prologue that holds the free list
+   heads. */
+#define HEAP_INDEX_SIZE (NUM_SIZE_CLASSES * WORD_SIZE)
+
+#elif FREE_INDEX == FREE_INDEX_TLSF
+
+/* log2 of the number of second-level lists per first-level range. */
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+
+/* Blocks smaller than TLSF_SMALL_SIZE all share first-level list 0,
+   whose second-level lists are ALIGNMENT bytes apart.  Above it, first
+   level fl covers [2^(fl+TLSF_FL_SHIFT-1), 2^(fl+TLSF_FL_SHIFT)). */
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + ALIGNMENT_LOG2)
+#define TLSF_SMALL_SIZE ((size_t)1 << TLSF_FL_SHIFT)
+
+/* Largest block size (log2) the index distinguishes; anything bigger
+   shares the last list of the last first-level range. */
+#define TLSF_FL_MAX 40
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 2)
+
+/* The TLSF control block.  With TLSF_FL_COUNT * TLSF_SL_COUNT heads it
+   is several KB, which would dominate small heaps if it were kept in
+   the heap prologue like the segregated list heads, so each arena keeps
+   its own in static storage, reset when the arena gets its first
+   segment.  Like the tcaches and the Arena structs themselves, it is
+   allocator state outside the heap and so does not count against
+   utilization. */
+typedef struct {
+  // Bit fl is set iff some second-level list of first level fl is
+  // non-empty.
+  unsigned long flBitmap;
+  // Bit sl of slBitmap[fl] is set iff heads[fl][sl] is non-empty.
+  unsigned int slBitmap[TLSF_FL_COUNT];
+  BlockInfo *heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} TLSFControl;
+
+/* The control block of the current arena. */
+#define TLSF (curArena->tlsf)
+
+/* Pointer to the first BlockInfo in the free list (fl, sl). */
+#define FREE_LIST_HEAD(fl, sl) (TLSF.heads[fl][sl])
+
+/* No free list heads are kept in the heap. */
+#define HEAP_INDEX_SIZE 0
+
+#elif FREE_INDEX == FREE_INDEX_TREE
+
+/* A TreeNode overlays a free block that is big enough to hold the tree
+   links after the BlockInfo fields.  Only one block of each size is
+   linked into the tree; the other free blocks of that size hang off it
+   in a list threaded through next and prev (the tree node is the head
+   of that list, so its prev is NULL).
+
+   +--------------+
+   | sizeAndTags  |
+   +--------------+
+   |     next     |  <-  next block of the same size
+   +--------------+
+   |     prev     |
+   +--------------+
+   |     left     |  <-  smaller sizes
+   +--------------+
+   |    right     |  <-  larger sizes
+   +--------------+
+   | parent/color |
+   +--------------+
+   |     ...      |
+   +--------------+
+   | boundary tag |
+   +--------------+
+*/
+struct TreeNode {
+  BlockInfo info;
+  LinkWord left;
+  LinkWord right;
+  // Link to the parent node, with TREE_RED and TREE_LINKED in the low
+  // bits.  Zero for blocks that are chained off a tree node.
+  LinkWord parentAndTags;
+};
+typedef struct TreeNode TreeNode;
+
+/* Follow or set the child links of a tree node. */
+#define TREE_LEFT(node) ((TreeNode *)LINK_PTR((node)->left))
+#define TREE_RIGHT(node) ((TreeNode *)LINK_PTR((node)->right))
+#define SET_TREE_LEFT(node, ptr) ((node)->left = PTR_LINK(ptr))
+#define SET_TREE_RIGHT(node, ptr) ((node)->right = PTR_LINK(ptr))
+
+/* parentAndTags bit for a red node. */
+#define TREE_RED 1
+
+/* parentAndTags bit set iff the block is linked into the tree (rather
+   than chained off a node of the same size). */
+#define TREE_LINKED 2
+
+#define TREE_PARENT(node) ((TreeNode *)LINK_PTR((node)->parentAndTags & ~(LinkWord)3))
+#define TREE_IS_RED(node) ((node) != NULL && ((node)->parentAndTags & TREE_RED))
+
+/* Smallest block that can be linked into the tree (the TreeNode plus a
+   boundary tag, rounded up to the alignment). */
+#define TREE_MIN_SIZE \
+  ((sizeof(TreeNode) + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* Blocks of MIN_BLOCK_SIZE up to TREE_MIN_SIZE bytes are kept in one
+   exact-size list per ALIGNMENT step. */
+#define NUM_SMALL_LISTS ((TREE_MIN_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT)
+
+/* The root of the tree is stored in the first word of the current
+   arena's prologue, and the heads of the small lists in the words that
+   follow it. */
+#define TREE_ROOT (*(TreeNode **)curArena->prologue)
+#define SMALL_LIST_HEAD(size) \
+  (((BlockInfo **)curArena->prologue)[1 + ((size) - MIN_BLOCK_SIZE) / ALIGNMENT])
+
+/* Size of the part of the heap prologue that holds the root and small
+   list heads, rounded up to the alignment. */
+#define HEAP_INDEX_SIZE \
+  (((1 + NUM_SMALL_LISTS) * WORD_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+#else
+#error "Unknown FREE_INDEX"
+#endif
 
 /* Size of a word on this architecture. In a x64 Machine, it is 8 bytes*/
 #define WORD_SIZE sizeof(void*)
 
-/* Minimum block size (to account for size header, next ptr, prev ptr,
-   and boundary tag) */
-#define MIN_BLOCK_SIZE (sizeof(BlockInfo) + WORD_SIZE)
+/* Size of a block header or boundary tag. */
+#define HEADER_SIZE sizeof(Tag)
 
-/* Alignment of blocks returned by mm_malloc. */
-#define ALIGNMENT 8
+/* Minimum block size (to account for size header, next link, prev link,
+   and boundary tag), rounded up to the alignment. */
+#define MIN_BLOCK_SIZE \
+  ((sizeof(BlockInfo) + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* Size of the heap prologue: the free list heads, if any, padded so
+   that the payload of the first block (HEADER_SIZE bytes past its
+   header) is ALIGNMENT-byte aligned.  Every block size is a multiple
+   of ALIGNMENT, so every later payload is aligned too. */
+#define HEAP_PROLOGUE_SIZE \
+  (HEAP_INDEX_SIZE + (ALIGNMENT - HEADER_SIZE) % ALIGNMENT)
 
 /* SIZE(blockInfo->sizeAndTags) extracts the size of a 'sizeAndTags' field.
    Also, calling SIZE(size) selects just the higher bits of 'size' to ensure
@@ -108,11 +320,13 @@ typedef struct BlockInfo BlockInfo;
         ^                                       ^
       high bit                               low bit
 
-   Since ALIGNMENT == 8, we reserve the low 3 bits of sizeAndTags for tag
-   bits, and we use bits 3-63 to store the size.
+   Since ALIGNMENT >= 8, we reserve the low 3 bits of sizeAndTags for tag
+   bits, and we use bits 3-63 to store the size (bits 3-31 with
+   MM_COMPACT).
 
    Bit 0 (2^0 == 1): TAG_USED
    Bit 1 (2^1 == 2): TAG_PRECEDING_USED
+   Bit 2 (2^2 == 4): TAG_GROWN
 */
 #define SIZE(x) ((x) & ~(ALIGNMENT - 1))
 
@@ -125,6 +339,323 @@ typedef struct BlockInfo BlockInfo;
    of the previous block from its boundary tag */
 #define TAG_PRECEDING_USED 2
 
+/* TAG_GROWN marks a used block that mm_realloc grew, and which is so
+   likely to grow again; see heapRealloc(). */
+#define TAG_GROWN 4
+
+/* The header of a block that has a mapping of its own (see DIRECT
+   MAPPINGS) instead of a place in the heap: a used block of size 0,
+   which no block in the heap can be. */
+#define TAG_MAPPED TAG_USED
+
+
+/******** ARENAS *****************************************************/
+
+
+/* The heap is shared by up to NUM_ARENAS independent arenas, each with
+   its own lock, free index and slabs, so that threads working in
+   different arenas never wait for each other.  Threads are handed
+   arenas round-robin the first time they call the allocator after
+   mm_init; the first (normally the thread that called mm_init) gets
+   arena 0, the main arena.
+
+   An arena owns one or more segments of the memlib heap, each laid out
+   like the whole heap used to be: a prologue (holding the free list
+   heads, for the first segment of an arena, and padding), blocks, and
+   an epilogue word tagged used.  The first block of a segment is tagged
+   with TAG_PRECEDING_USED, so blocks never coalesce across segments.
+   When an arena grows and nothing else was taken from memlib since its
+   last growth, the new space simply extends its newest segment.
+
+   The space at the end of an arena's newest segment is its top chunk,
+   which is kept out of the free index: blocks that no free block fits
+   are carved off its front, and a block freed next to it is merged back
+   into it.  The top chunk is tagged used, so that its neighbor never
+   coalesces with it on its own, and needs no boundary tag; when it is
+   empty, it is the epilogue word itself.
+
+   The main arena starts at the bottom of the heap.  Any other arena
+   gets its first segment the first time a thread assigned to it needs
+   space, and always grows by whole CHUNK_SIZE-aligned chunks, which it
+   claims in the chunk map (see below) so that mm_free can tell which
+   arena a block belongs to. */
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 8
+#endif
+
+#if NUM_ARENAS < 1 || NUM_ARENAS > 128
+#error "NUM_ARENAS must be between 1 and 128"
+#endif
+
+/* Granularity (and alignment) of the space claimed by non-main arenas;
+   a power of two. */
+#define CHUNK_SIZE 4096
+
+/* Number of quick-lists per arena (0 disables them); see QUICK-LISTS
+   below. */
+#ifndef QUICK_LISTS
+#define QUICK_LISTS 64
+#endif
+
+/* A list of freed, not yet coalesced blocks of exactly 'size' bytes,
+   linked through their next fields. */
+typedef struct {
+  size_t size;
+  BlockInfo* head;
+} QuickList;
+
+/* Free blocks of at least PURGE_MIN_SIZE bytes whose pages may be
+   given back to the system (0 disables purging); see PURGING below. */
+#ifndef PURGE_MIN_SIZE
+#define PURGE_MIN_SIZE (64 * 1024)
+#endif
+
+/* Number of purge candidates each arena tracks. */
+#define PURGE_SLOTS 32
+
+/* A large free block, when it was freed (in milliseconds) and whether
+   its pages were given back yet. */
+typedef struct {
+  BlockInfo* block;
+  unsigned long long freedAt;
+  int purged;
+} PurgeCandidate;
+
+struct Arena {
+  pthread_mutex_t lock;
+  // Index of the arena in arenas[].
+  unsigned int id;
+#if FREE_INDEX == FREE_INDEX_TLSF
+  TLSFControl tlsf;
+#else
+  // Start of the arena's first segment, whose prologue holds the heads
+  // of its free lists.
+  char* prologue;
+#endif
+  // The epilogue word of the arena's newest segment, or NULL if it has
+  // no segment yet.
+  Tag* epilogue;
+  // The top chunk of the newest segment, which ends at the epilogue.
+  BlockInfo* top;
+  // Every byte from here up to the epilogue is still zero: the end of
+  // the top chunk that no block was ever carved from (see mm_calloc).
+  char* untouched;
+  // Whether the block allocFromTop() carved last lies past untouched.
+  int carvedUntouched;
+  // No block in the free index is bigger than this.
+  size_t maxFreeSize;
+  // Blocks freed by threads assigned to other arenas, linked through
+  // their first payload word and not yet returned to the free index.
+  // Pushed without the lock; see REMOTE FREES.
+  void* remoteFrees;
+  // Number of allocBlock() calls so far, the value it had when the
+  // arena last grew, and how much that growth was at least.
+  unsigned long allocCount;
+  unsigned long lastGrowth;
+  size_t growSize;
+#if QUICK_LISTS > 0
+  QuickList quick[QUICK_LISTS];
+  // Number of blocks on the quick-lists.
+  unsigned int quickCount;
+#endif
+#if PURGE_MIN_SIZE > 0
+  // Slots with a NULL block are unused.
+  PurgeCandidate purge[PURGE_SLOTS];
+  // Number of slots in use.
+  unsigned int purgeCount;
+#endif
+};
+typedef struct Arena Arena;
+
+static Arena arenas[NUM_ARENAS];
+
+/* The arena whose lock the calling thread holds.  Everything below that
+   touches the free index or the slabs works on this arena. */
+static __thread Arena* curArena;
+
+/* Lock arena and make it the current arena. */
+static void lockArena(Arena* arena) {
+  pthread_mutex_lock(&arena->lock);
+  curArena = arena;
+}
+
+/* Unlock the current arena. */
+static void unlockArena() {
+  Arena *arena = curArena;
+
+  curArena = NULL;
+  pthread_mutex_unlock(&arena->lock);
+}
+
+
+/******** PURGING ****************************************************/
+
+
+/* A free block of at least PURGE_MIN_SIZE bytes is a purge candidate of
+   its arena from when it is coalesced until it leaves the free index.
+   A candidate that has stayed free for purgeDecayMs milliseconds, or
+   every candidate when mm_purge() is called, is purged: the whole pages
+   inside the block, past its free index links and before its boundary
+   tag, are given back to the system with madvise(MADV_DONTNEED).  The
+   block stays where it is; the pages are faulted back in, zeroed, when
+   the block is used again.  Candidates that do not fit in the arena's
+   PURGE_SLOTS slots are not tracked. */
+#if PURGE_MIN_SIZE > 0
+
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 1000
+#endif
+
+/* An arena looks for decayed candidates every PURGE_CHECK_INTERVAL
+   calls to allocBlock() (a power of two). */
+#define PURGE_CHECK_INTERVAL 64
+
+#if FREE_INDEX == FREE_INDEX_TREE
+#define FREE_BLOCK_LINKS sizeof(TreeNode)
+#else
+#define FREE_BLOCK_LINKS sizeof(BlockInfo)
+#endif
+
+static long purgeDecayMs = PURGE_DECAY_MS;
+
+/* Totals over all arenas, for mm_purge_stats(). */
+static unsigned long purgedBlocks;
+static unsigned long purgedPages;
+static unsigned long refaultedPages;
+
+/* Milliseconds on the monotonic clock. */
+static unsigned long long nowMs() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The first and last page boundaries inside a free block, between
+   which its pages may be purged, for its first size bytes. */
+static char* purgeStart(BlockInfo* block) {
+  size_t pagesize = mem_pagesize();
+
+  return (char *)(((uintptr_t)block + FREE_BLOCK_LINKS + pagesize - 1) & ~(uintptr_t)(pagesize - 1));
+}
+
+static char* purgeEnd(BlockInfo* block, size_t size) {
+  return (char *)(((uintptr_t)block + size - HEADER_SIZE) & ~(uintptr_t)(mem_pagesize() - 1));
+}
+
+/* Return the number of resident pages in [start, end), which are page
+   aligned. */
+static size_t residentPages(char* start, char* end) {
+  unsigned char vec[256];
+  size_t pagesize = mem_pagesize();
+  size_t pages, i;
+  size_t count = 0;
+
+  while (start < end) {
+    pages = (end - start) / pagesize;
+    if (pages > sizeof(vec)) {
+      pages = sizeof(vec);
+    }
+    if (mincore(start, pages * pagesize, vec) != 0) {
+      break;
+    }
+    for (i = 0; i < pages; i++) {
+      count += vec[i] & 1;
+    }
+    start += pages * pagesize;
+  }
+  return count;
+}
+
+/* Return the current arena's candidate entry for the free block, or
+   NULL if it is not a candidate. */
+static PurgeCandidate* findPurgeCandidate(BlockInfo* block) {
+  int i;
+
+  if (curArena->purgeCount == 0 || SIZE(block->sizeAndTags) < PURGE_MIN_SIZE) {
+    return NULL;
+  }
+  for (i = 0; i < PURGE_SLOTS; i++) {
+    if (curArena->purge[i].block == block) {
+      return &curArena->purge[i];
+    }
+  }
+  return NULL;
+}
+
+/* Make the free block a candidate if it is big enough and a slot is
+   free.  A block just coalesced is freed now; the remainder of a split
+   candidate inherits its state from 'from'. */
+static void trackPurgeCandidate(BlockInfo* block, PurgeCandidate* from) {
+  int i;
+
+  if (SIZE(block->sizeAndTags) < PURGE_MIN_SIZE || curArena->purgeCount == PURGE_SLOTS) {
+    return;
+  }
+  for (i = 0; curArena->purge[i].block != NULL; i++)
+    ;
+  curArena->purge[i].block = block;
+  curArena->purge[i].freedAt = from != NULL ? from->freedAt : nowMs();
+  curArena->purge[i].purged = from != NULL ? from->purged : 0;
+  curArena->purgeCount++;
+}
+
+/* Stop tracking the block, which is leaving the free index. */
+static void forgetPurgeCandidate(BlockInfo* block) {
+  PurgeCandidate *candidate = findPurgeCandidate(block);
+
+  if (candidate != NULL) {
+    candidate->block = NULL;
+    curArena->purgeCount--;
+  }
+}
+
+/* Count the purged pages among the first size bytes of the candidate's
+   block, which are about to be handed out and faulted back in. */
+static void noteRefaults(PurgeCandidate* candidate, size_t size) {
+  char *start, *end;
+
+  if (!candidate->purged) {
+    return;
+  }
+  start = purgeStart(candidate->block);
+  end = purgeEnd(candidate->block, size);
+  if (start < end) {
+    __atomic_fetch_add(&refaultedPages,
+                       (end - start) / mem_pagesize() - residentPages(start, end),
+                       __ATOMIC_RELAXED);
+  }
+}
+
+/* Purge the current arena's candidates that have decayed, or all of
+   them if all is set. */
+static void purgeArena(int all) {
+  unsigned long long now = nowMs();
+  PurgeCandidate *candidate;
+  char *start, *end;
+  size_t pages;
+
+  for (candidate = curArena->purge; candidate < curArena->purge + PURGE_SLOTS; candidate++) {
+    if (candidate->block == NULL || candidate->purged ||
+        (!all && now - candidate->freedAt < (unsigned long long)purgeDecayMs)) {
+      continue;
+    }
+    candidate->purged = 1;
+    start = purgeStart(candidate->block);
+    end = purgeEnd(candidate->block, SIZE(candidate->block->sizeAndTags));
+    if (start < end) {
+      pages = residentPages(start, end);
+      madvise(start, end - start, MADV_DONTNEED);
+      __atomic_fetch_add(&purgedBlocks, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&purgedPages, pages, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+#endif /* PURGE_MIN_SIZE */
+
+static void examineFreeIndex();
+
 /*show the info of the curent heap*/
 int GLobalShow = 0;
 
@@ -132,473 +663,1913 @@ int GLobalShow = 0;
 static void examine_heap() {
   BlockInfo *block;
 
+
   /* print to stderr so output isn't buffered and not output if we crash */
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void *)FREE_LIST_HEAD);
+  examineFreeIndex();
 
-  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE); /* first block on heap */
+  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(mem_heap_lo(), HEAP_PROLOGUE_SIZE); /* first block on heap */
       SIZE(block->sizeAndTags) != 0 && block < mem_heap_hi();
       block = (BlockInfo *)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
 
     /* print out common block attributes */
     fprintf(stderr, "%p: %ld %ld %ld\t",
     (void *)block,
-    SIZE(block->sizeAndTags),
-    block->sizeAndTags & TAG_PRECEDING_USED,
-    block->sizeAndTags & TAG_USED);
+    (long)SIZE(block->sizeAndTags),
+    (long)(block->sizeAndTags & TAG_PRECEDING_USED),
+    (long)(block->sizeAndTags & TAG_USED));
 
     /* and allocated/free specific data */
     if (block->sizeAndTags & TAG_USED) {
       fprintf(stderr, "ALLOCATED\n");
     } else {
       fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-      (void *)block->next,
-      (void *)block->prev);
+      (void *)NEXT_FREE(block),
+      (void *)PREV_FREE(block));
     }
   }
   printf("block: %p\n", block);
-  printf("SIZE(block->sizeAndTags): %ld\n", SIZE(block->sizeAndTags));
+  printf("SIZE(block->sizeAndTags): %ld\n", (long)SIZE(block->sizeAndTags));
   printf("mem_heap_hi(): %p\n", mem_heap_hi());
   fprintf(stderr, "END OF HEAP\n\n");
 }
 
 
-/* Find a free block of the requested size in the free list.  Returns
-   NULL if no free block is large enough. */
+#if FREE_INDEX == FREE_INDEX_SEGLIST
+
+/* Return the size class whose free list holds blocks of size 'size'. */
+static int sizeClass(size_t size) {
+  size_t units;
+
+  if (size <= MIN_BLOCK_SIZE) {
+    return 0;
+  }
+  // floor(log2((size-1) / MIN_BLOCK_SIZE)) + 1, capped at the last class.
+  units = (size - 1) / MIN_BLOCK_SIZE;
+  return units >= ((size_t)1 << (NUM_SIZE_CLASSES - 2))
+    ? NUM_SIZE_CLASSES - 1
+    : (int)(8 * sizeof(long) - __builtin_clzl(units));
+}
+
+/* Print the free list heads. */
+static void examineFreeIndex() {
+  int class;
+
+  for (class = 0; class < NUM_SIZE_CLASSES; class++) {
+    fprintf(stderr, "FREE_LIST_HEAD(%d): %p\n", class,
+            (void *)FREE_LIST_HEAD(class));
+  }
+}
+
+/* Empty every free list. */
+static void initFreeIndex() {
+  int class;
+
+  for (class = 0; class < NUM_SIZE_CLASSES; class++) {
+    FREE_LIST_HEAD(class) = NULL;
+  }
+}
+
+/* Find a free block of the requested size in the free lists.  Only the
+   smallest class that can hold reqSize is searched first-fit; every
+   block in a larger class is big enough, so the head of the first
+   non-empty larger class is taken.  Returns NULL if no free block is
+   large enough. */
 static void * searchFreeList(size_t reqSize) {   
   BlockInfo* freeBlock;
+  int class = sizeClass(reqSize);
 
-  freeBlock = FREE_LIST_HEAD;
+  freeBlock = FREE_LIST_HEAD(class);
   while (freeBlock != NULL){
     if (SIZE(freeBlock->sizeAndTags) >= reqSize) {
       return freeBlock;
     } else {
-      freeBlock = freeBlock->next;
+      freeBlock = NEXT_FREE(freeBlock);
+    }
+  }
+  for (class++; class < NUM_SIZE_CLASSES; class++) {
+    if (FREE_LIST_HEAD(class) != NULL) {
+      return FREE_LIST_HEAD(class);
     }
   }
   return NULL;
 }
+
+/* Return the largest free block size searchFreeList(reqSize) may have
+   passed over when it returned NULL.  The search is exhaustive, so no
+   free block is as big as reqSize. */
+static size_t searchMissBound(size_t reqSize) {
+  return reqSize - 1;
+}
            
-/* Insert freeBlock at the head of the list.  (LIFO) */
+/* Insert freeBlock at the head of the list of its size class.  (LIFO) */
 static void insertFreeBlock(BlockInfo* freeBlock) {
-  //printf("in insertFreeBlock\n");
-  // printf("freeBlock %p\n", freeBlock);
-  // printf("FREE_LIST_HEAD: %p\n", FREE_LIST_HEAD);
-  BlockInfo* oldHead = FREE_LIST_HEAD;
-  // printf("oldHead: %p\n", oldHead);
-  freeBlock->next = oldHead;
+  int class = sizeClass(SIZE(freeBlock->sizeAndTags));
+  BlockInfo* oldHead = FREE_LIST_HEAD(class);
+  SET_NEXT_FREE(freeBlock, oldHead);
   if (oldHead != NULL) {
-    // printf("oldHead next: %p\n", oldHead->next);
-    //printf("oldHead not NULL\n");
-    oldHead->prev = freeBlock;
+    SET_PREV_FREE(oldHead, freeBlock);
   }
-  freeBlock->prev = NULL;
-  FREE_LIST_HEAD = freeBlock;
+  SET_PREV_FREE(freeBlock, NULL);
+  FREE_LIST_HEAD(class) = freeBlock;
 }      
 
-/* Remove a free block from the free list. */
+/* Remove a free block from the free list of its size class.  The
+   block's size must not have changed since it was inserted. */
 static void removeFreeBlock(BlockInfo* freeBlock) {
   BlockInfo *nextFree, *prevFree;
   
-  nextFree = freeBlock->next;//nextFree = NULL
-  prevFree = freeBlock->prev;//prevFree = null
-
+#if PURGE_MIN_SIZE > 0
+  forgetPurgeCandidate(freeBlock);
+#endif
+  nextFree = NEXT_FREE(freeBlock);
+  prevFree = PREV_FREE(freeBlock);
 
   // If the next block is not null, patch its prev pointer.
   if (nextFree != NULL) {
-    nextFree->prev = prevFree;
+    SET_PREV_FREE(nextFree, prevFree);
   }
 
   // If we're removing the head of the free list, set the head to be
   // the next block, otherwise patch the previous block's next pointer.
-  if (freeBlock == FREE_LIST_HEAD) {
-    FREE_LIST_HEAD = nextFree;
-    // printf("second FREE_LIST_HEAD: %p\n", FREE_LIST_HEAD);
+  if (prevFree == NULL) {
+    FREE_LIST_HEAD(sizeClass(SIZE(freeBlock->sizeAndTags))) = nextFree;
   } else {
+    SET_NEXT_FREE(prevFree, nextFree);
+  }
+}
 
-    prevFree->next = nextFree;//0038->next = NULL
+#elif FREE_INDEX == FREE_INDEX_TLSF
+
+/* Map a block size to the free list (fl, sl) that holds blocks of that
+   size. */
+static void tlsfMapping(size_t size, int *fl, int *sl) {
+  int log2;
+
+  if (size < TLSF_SMALL_SIZE) {
+    *fl = 0;
+    *sl = (int)(size / ALIGNMENT);
+  } else {
+    log2 = (int)(8 * sizeof(long) - 1 - __builtin_clzl(size));
+    if (log2 > TLSF_FL_MAX) {
+      *fl = TLSF_FL_COUNT - 1;
+      *sl = TLSF_SL_COUNT - 1;
+      return;
+    }
+    *fl = log2 - TLSF_FL_SHIFT + 1;
+    *sl = (int)(size >> (log2 - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
   }
 }
 
-/* Coalesce 'oldBlock' with any preceeding or following free blocks. */
-static void coalesceFreeBlock(BlockInfo* oldBlock) {
-  BlockInfo *blockCursor;
-  BlockInfo *newBlock;
-  BlockInfo *freeBlock;
-  // size of old block
-  size_t oldSize = SIZE(oldBlock->sizeAndTags);
-  // printf("oldSize: %ld\n", oldSize);
-  // running sum to be size of final coalesced block
-  size_t newSize = oldSize;
+/* Print the non-empty free list heads. */
+static void examineFreeIndex() {
+  int fl, sl;
 
-  // Coalesce with any preceding free block
-  blockCursor = oldBlock;
-  while ((blockCursor->sizeAndTags & TAG_PRECEDING_USED)==0) { 
-    // While the block preceding this one in memory (not the
-    // prev. block in the free list) is free:
-  //   if (GLobalShow)
-  // {
-  //   printf("Coalesce with any preceding free block\n");
-  // }
-    //
-    // Get the size of the previous block from its boundary tag.
-    size_t size = SIZE(*((size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE)));
-    // Use this size to find the block info for that block.
-    // printf("free size: %ld\n" ,size);
-    freeBlock = (BlockInfo*)UNSCALED_POINTER_SUB(blockCursor, size);
-    // printf("free freeBlock: %p\n" ,freeBlock);
-    // Remove that block from free list.
+  fprintf(stderr, "flBitmap: %#lx\n", TLSF.flBitmap);
+  for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+    for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+      if (FREE_LIST_HEAD(fl, sl) != NULL) {
+        fprintf(stderr, "FREE_LIST_HEAD(%d, %d): %p\n", fl, sl,
+                (void *)FREE_LIST_HEAD(fl, sl));
+      }
+    }
+  }
+}
 
-    removeFreeBlock(freeBlock);
+/* Empty every free list. */
+static void initFreeIndex() {
+  memset(&TLSF, 0, sizeof(TLSF));
+}
 
-    // Count that block's size and update the current block pointer.
-    newSize += size;
-    blockCursor = freeBlock;
+/* Find a free block of at least the requested size in constant time.
+   The head of the list reqSize itself maps to is tried first, so that
+   an exact or near fit is not passed over.  Otherwise reqSize is
+   rounded up to the next list boundary so that every block in the list
+   it maps to, and in every larger list, is big enough; the smallest
+   such non-empty list is then found from the bitmaps.  Returns NULL if
+   no free block is large enough. */
+static void * searchFreeList(size_t reqSize) {
+  int fl, sl;
+  unsigned int slMap;
+  unsigned long flMap;
+  BlockInfo *freeBlock;
 
+  tlsfMapping(reqSize, &fl, &sl);
+  freeBlock = FREE_LIST_HEAD(fl, sl);
+  if (freeBlock != NULL && SIZE(freeBlock->sizeAndTags) >= reqSize) {
+    return freeBlock;
   }
-  newBlock = blockCursor;
-  
-  // Coalesce with any following free block.
-  // Start with the block following this one in memory
-  blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(oldBlock, oldSize);
-  // printf("blockCursor boundary: %p\n", blockCursor);
-  // printf("blockCursor->sizeAndTags: %ld\n",blockCursor->sizeAndTags);
-  while ((blockCursor->sizeAndTags & TAG_USED)==0) {
-    // While the block is free:
-  //   if (GLobalShow)
-  // {
-  //   printf("Coalesce with any following free block.\n"); 
-  // }
-    //
-    size_t size = SIZE(blockCursor->sizeAndTags);
-    // Remove it from the free list.
-    removeFreeBlock(blockCursor);
-    // Count its size and step to the following block.
-    newSize += size;
-    blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(blockCursor, size);
+
+  if (reqSize >= TLSF_SMALL_SIZE) {
+    reqSize += ((size_t)1 << (8 * sizeof(long) - 1 - __builtin_clzl(reqSize)
+                              - TLSF_SL_LOG2)) - 1;
+  }
+  tlsfMapping(reqSize, &fl, &sl);
+
+  // Blocks too large for the index all share the last list, which
+  // is the only one that must be searched.
+  if (fl == TLSF_FL_COUNT - 1 && sl == TLSF_SL_COUNT - 1) {
+    freeBlock = FREE_LIST_HEAD(fl, sl);
+    while (freeBlock != NULL && SIZE(freeBlock->sizeAndTags) < reqSize) {
+      freeBlock = NEXT_FREE(freeBlock);
+    }
+    return freeBlock;
   }
-  
-  // If the block actually grew, remove the old entry from the free
-  // list and add the new entry.
-  if (newSize != oldSize) {
-    // Remove the original block from the free list
-    removeFreeBlock(oldBlock);
 
-    // Save the new size in the block info and in the boundary tag
-    // and tag it to show the preceding block is used (otherwise, it
-    // would have become part of this one!).
-    newBlock->sizeAndTags = newSize | TAG_PRECEDING_USED;
-    ////printf("newSize: %ld\n", newSize);
-    // The boundary tag of the preceding block is the word immediately
-    // preceding block in memory where we left off advancing blockCursor.
-    *(size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE) = newSize | TAG_PRECEDING_USED;  
-    //printf("Size after coalesce: %ld\n", SIZE(newBlock->sizeAndTags));
-    // Put the new block in the free list.
-    // printf("Current block: %p\n", newBlock);
-    // printf("          next block: %ld\n", *((size_t*)UNSCALED_POINTER_ADD(newBlock, newSize)));
-    insertFreeBlock(newBlock);
-    
+  slMap = TLSF.slBitmap[fl] & (~0U << sl);
+  if (slMap == 0) {
+    // Nothing left in this range; move to the next non-empty one.
+    flMap = TLSF.flBitmap & (~0UL << (fl + 1));
+    if (flMap == 0) {
+      return NULL;
+    }
+    fl = __builtin_ctzl(flMap);
+    slMap = TLSF.slBitmap[fl];
   }
-  return;
+  sl = __builtin_ctz(slMap);
+  return FREE_LIST_HEAD(fl, sl);
 }
 
-/* Get more heap space of size at least reqSize. */
-static void requestMoreSpace(size_t reqSize) {
-  size_t pagesize = mem_pagesize();
-  size_t numPages = (reqSize + pagesize - 1) / pagesize;
-  BlockInfo *newBlock;
-  size_t totalSize = numPages * pagesize;
-  size_t prevLastWordMask;
-  //printf("totalSize: %ld\n", totalSize);
-  void* mem_sbrk_result = mem_sbrk(totalSize);
-  // printf("......................mem_sbrk_result: %p\n", mem_sbrk_result);
-  if ((size_t)mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in requestMoreSpace\n");
-    exit(0);
+/* Return the largest free block size searchFreeList(reqSize) may have
+   passed over when it returned NULL.  Only the head of the list reqSize
+   maps to is looked at, so unless every block of that list is big
+   enough (reqSize is its lower edge, or the list holds one size), a
+   block just below the list's upper edge may still be in it.  Blocks
+   too large for the index share one list and are not bounded. */
+static size_t searchMissBound(size_t reqSize) {
+  size_t step;
+  int log2;
+
+  if (reqSize < TLSF_SMALL_SIZE) {
+    return reqSize - 1;
   }
-  newBlock = (BlockInfo*)UNSCALED_POINTER_SUB(mem_sbrk_result, WORD_SIZE);
-  
-  
-  /* initialize header, inherit TAG_PRECEDING_USED status from the
-     previously useless last word however, reset the fake TAG_USED
-     bit */
-  prevLastWordMask = newBlock->sizeAndTags & TAG_PRECEDING_USED;
-  
-  
-  // if (GLobalShow)
-  // {
-  //   printf("prevLastWordMask: %ld\n", prevLastWordMask);
-  //   printf("newBlock->sizeAndTags: %p\n", &(newBlock->sizeAndTags));
-  // }
-  newBlock->sizeAndTags = totalSize | prevLastWordMask;
-  //examine_heap();   
-  // Initialize boundary tag.
-  ((BlockInfo*)UNSCALED_POINTER_ADD(newBlock, totalSize - WORD_SIZE))->sizeAndTags = 
-    totalSize | prevLastWordMask;
+  log2 = (int)(8 * sizeof(long) - 1 - __builtin_clzl(reqSize));
+  if (log2 > TLSF_FL_MAX) {
+    return SIZE_MAX;
+  }
+  step = (size_t)1 << (log2 - TLSF_SL_LOG2);
+  return (reqSize & (step - 1)) == 0 ? reqSize - 1 : (reqSize | (step - 1));
+}
 
-  /* initialize "new" useless last word
-     the previous block is free at this moment
-     but this word is useless, so its use bit is set
-     This trick lets us do the "normal" check even at the end of
-     the heap and avoid a special check to see if the following
-     block is the end of the heap... */
-  *((size_t*)UNSCALED_POINTER_ADD(newBlock, totalSize)) = TAG_USED;
-  // Add the new block to the free list and immediately coalesce newly
-  // allocated memory space
-  // printf("          next block: %ld\n", *((size_t*)UNSCALED_POINTER_ADD(newBlock, totalSize)));
-  insertFreeBlock(newBlock);
-  // printf("after insert\n");
-  // examine_heap();
-  coalesceFreeBlock(newBlock);
-  // printf("after coalesceFreeBlock\n");
-  // examine_heap();
+/* Insert freeBlock at the head of the list for its size.  (LIFO) */
+static void insertFreeBlock(BlockInfo* freeBlock) {
+  int fl, sl;
+  BlockInfo* oldHead;
 
+  tlsfMapping(SIZE(freeBlock->sizeAndTags), &fl, &sl);
+  oldHead = FREE_LIST_HEAD(fl, sl);
+  SET_NEXT_FREE(freeBlock, oldHead);
+  if (oldHead != NULL) {
+    SET_PREV_FREE(oldHead, freeBlock);
+  }
+  SET_PREV_FREE(freeBlock, NULL);
+  FREE_LIST_HEAD(fl, sl) = freeBlock;
+  TLSF.flBitmap |= 1UL << fl;
+  TLSF.slBitmap[fl] |= 1U << sl;
 }
 
+/* Remove a free block from the list for its size.  The block's size
+   must not have changed since it was inserted. */
+static void removeFreeBlock(BlockInfo* freeBlock) {
+  BlockInfo *nextFree, *prevFree;
+  int fl, sl;
 
+#if PURGE_MIN_SIZE > 0
+  forgetPurgeCandidate(freeBlock);
+#endif
+  nextFree = NEXT_FREE(freeBlock);
+  prevFree = PREV_FREE(freeBlock);
 
-/* Initialize the allocator. */
-int mm_init () {
-  // Head of the free list.
-  BlockInfo *firstFreeBlock;
+  // If the next block is not null, patch its prev pointer.
+  if (nextFree != NULL) {
+    SET_PREV_FREE(nextFree, prevFree);
+  }
 
-  // Initial heap size: WORD_SIZE byte heap-header (stores pointer to head
-  // of free list), MIN_BLOCK_SIZE bytes of space, WORD_SIZE byte heap-footer.
-  // initSize: 48
-  // MIN_BLOCK_SIZE: 32
-  // WORD_SIZE: 8
+  // If we're removing the head of the list, set the head to be the
+  // next block and clear the bitmaps if the list is now empty,
+  // otherwise patch the previous block's next pointer.
+  if (prevFree == NULL) {
+    tlsfMapping(SIZE(freeBlock->sizeAndTags), &fl, &sl);
+    FREE_LIST_HEAD(fl, sl) = nextFree;
+    if (nextFree == NULL) {
+      TLSF.slBitmap[fl] &= ~(1U << sl);
+      if (TLSF.slBitmap[fl] == 0) {
+        TLSF.flBitmap &= ~(1UL << fl);
+      }
+    }
+  } else {
+    SET_NEXT_FREE(prevFree, nextFree);
+  }
+}
 
-  size_t initSize = WORD_SIZE+MIN_BLOCK_SIZE+WORD_SIZE;
-  size_t totalSize;
-  void* mem_sbrk_result = mem_sbrk(initSize);
-  //  //printf("mem_sbrk returned %p\n", mem_sbrk_result);
-  if ((ssize_t)mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", 
-           mem_sbrk_result);
-    exit(1);
+#elif FREE_INDEX == FREE_INDEX_TREE
+
+/* Print the tree root and the small list heads. */
+static void examineFreeIndex() {
+  size_t size;
+
+  fprintf(stderr, "TREE_ROOT: %p\n", (void *)TREE_ROOT);
+  for (size = MIN_BLOCK_SIZE; size < TREE_MIN_SIZE; size += ALIGNMENT) {
+    fprintf(stderr, "SMALL_LIST_HEAD(%zu): %p\n", size,
+            (void *)SMALL_LIST_HEAD(size));
   }
+}
 
-  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
+/* Empty the tree and the small lists. */
+static void initFreeIndex() {
+  size_t size;
 
-  // Total usable size is full size minus heap-header and heap-footer words
-  // NOTE: These are different than the "header" and "footer" of a block!
-  // The heap-header is a pointer to the first free block in the free list.
-  // The heap-footer is used to keep the data structures consistent (see
-  // requestMoreSpace() for more info, but you should be able to ignore it).
-  totalSize = initSize - WORD_SIZE - WORD_SIZE;
-
-  // The heap starts with one free block, which we initialize now.
-  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED;
-  firstFreeBlock->next = NULL;
-  firstFreeBlock->prev = NULL;
-  // boundary tag
-  *((size_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize - WORD_SIZE)) = totalSize | TAG_PRECEDING_USED;
-  
-  // Tag "useless" word at end of heap as used.
-  // This is the is the heap-footer.
-  *((size_t*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
-  // printf("\nfirstFreeBlock next block: %ld\n", *((size_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize)));
-  // set the head of the free list to this new free block.
-  FREE_LIST_HEAD = firstFreeBlock;
-  //examine_heap();
-  return 0;
+  TREE_ROOT = NULL;
+  for (size = MIN_BLOCK_SIZE; size < TREE_MIN_SIZE; size += ALIGNMENT) {
+    SMALL_LIST_HEAD(size) = NULL;
+  }
 }
 
+/* Set the parent of node, keeping its tags. */
+static void treeSetParent(TreeNode* node, TreeNode* parent) {
+  node->parentAndTags = PTR_LINK(parent) | (node->parentAndTags & 3);
+}
 
-// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+/* Make node red or black. */
+static void treeSetRed(TreeNode* node, int red) {
+  node->parentAndTags = (node->parentAndTags & ~(LinkWord)TREE_RED) |
+    (red ? TREE_RED : 0);
+}
 
+/* Put 'replacement' where 'node' hangs off its parent (or the root). */
+static void treeReplaceChild(TreeNode* node, TreeNode* replacement) {
+  TreeNode *parent = TREE_PARENT(node);
 
-/* Allocate a block of size size and return a pointer to it. */
-void* mm_malloc (size_t size) {
-  size_t reqSize;
-  BlockInfo * ptrFreeBlock = NULL;
-  size_t precedingBlockUseTag;
-  size_t oldSize;
-  BlockInfo * newBlock = NULL;
-  BlockInfo * followingBlock;
-  // examine_heap();
-  // Zero-size requests get NULL.
-  if (size == 0) {
-    return NULL;
+  if (parent == NULL) {
+    TREE_ROOT = replacement;
+  } else if (TREE_LEFT(parent) == node) {
+    SET_TREE_LEFT(parent, replacement);
+  } else {
+    SET_TREE_RIGHT(parent, replacement);
   }
+}
 
-  // Add one word for the initial size header.
-  // Note that we don't need to boundary tag when the block is used!
-  size += WORD_SIZE;
-  if (size <= MIN_BLOCK_SIZE) {
-    // Make sure we allocate enough space for a blockInfo in case we
-    // free this block (when we free this block, we'll need to use the
-    // next pointer, the prev pointer, and the boundary tag).
-    reqSize = MIN_BLOCK_SIZE;
+/* Rotate node's right child up into node's place. */
+static void treeRotateLeft(TreeNode* node) {
+  TreeNode *child = TREE_RIGHT(node);
+
+  SET_TREE_RIGHT(node, TREE_LEFT(child));
+  if (TREE_LEFT(child) != NULL) {
+    treeSetParent(TREE_LEFT(child), node);
+  }
+  treeReplaceChild(node, child);
+  treeSetParent(child, TREE_PARENT(node));
+  SET_TREE_LEFT(child, node);
+  treeSetParent(node, child);
+}
+
+/* Rotate node's left child up into node's place. */
+static void treeRotateRight(TreeNode* node) {
+  TreeNode *child = TREE_LEFT(node);
+
+  SET_TREE_LEFT(node, TREE_RIGHT(child));
+  if (TREE_RIGHT(child) != NULL) {
+    treeSetParent(TREE_RIGHT(child), node);
+  }
+  treeReplaceChild(node, child);
+  treeSetParent(child, TREE_PARENT(node));
+  SET_TREE_RIGHT(child, node);
+  treeSetParent(node, child);
+}
+
+/* Restore the red-black properties after linking the red leaf 'node'. */
+static void treeInsertFixup(TreeNode* node) {
+  TreeNode *parent, *grandparent, *uncle;
+
+  while (TREE_IS_RED(parent = TREE_PARENT(node))) {
+    grandparent = TREE_PARENT(parent);
+    if (parent == TREE_LEFT(grandparent)) {
+      uncle = TREE_RIGHT(grandparent);
+      if (TREE_IS_RED(uncle)) {
+        treeSetRed(parent, 0);
+        treeSetRed(uncle, 0);
+        treeSetRed(grandparent, 1);
+        node = grandparent;
+        continue;
+      }
+      if (node == TREE_RIGHT(parent)) {
+        node = parent;
+        treeRotateLeft(node);
+        parent = TREE_PARENT(node);
+      }
+      treeSetRed(parent, 0);
+      treeSetRed(grandparent, 1);
+      treeRotateRight(grandparent);
+    } else {
+      uncle = TREE_LEFT(grandparent);
+      if (TREE_IS_RED(uncle)) {
+        treeSetRed(parent, 0);
+        treeSetRed(uncle, 0);
+        treeSetRed(grandparent, 1);
+        node = grandparent;
+        continue;
+      }
+      if (node == TREE_LEFT(parent)) {
+        node = parent;
+        treeRotateRight(node);
+        parent = TREE_PARENT(node);
+      }
+      treeSetRed(parent, 0);
+      treeSetRed(grandparent, 1);
+      treeRotateLeft(grandparent);
+    }
+  }
+  treeSetRed(TREE_ROOT, 0);
+}
+
+/* Restore the red-black properties after a black node was unlinked
+   from under 'parent', leaving 'node' (possibly NULL) in its place. */
+static void treeRemoveFixup(TreeNode* node, TreeNode* parent) {
+  TreeNode *sibling;
+
+  while (node != TREE_ROOT && !TREE_IS_RED(node)) {
+    if (node == TREE_LEFT(parent)) {
+      sibling = TREE_RIGHT(parent);
+      if (TREE_IS_RED(sibling)) {
+        treeSetRed(sibling, 0);
+        treeSetRed(parent, 1);
+        treeRotateLeft(parent);
+        sibling = TREE_RIGHT(parent);
+      }
+      if (!TREE_IS_RED(TREE_LEFT(sibling)) && !TREE_IS_RED(TREE_RIGHT(sibling))) {
+        treeSetRed(sibling, 1);
+        node = parent;
+        parent = TREE_PARENT(node);
+      } else {
+        if (!TREE_IS_RED(TREE_RIGHT(sibling))) {
+          treeSetRed(TREE_LEFT(sibling), 0);
+          treeSetRed(sibling, 1);
+          treeRotateRight(sibling);
+          sibling = TREE_RIGHT(parent);
+        }
+        treeSetRed(sibling, TREE_IS_RED(parent));
+        treeSetRed(parent, 0);
+        treeSetRed(TREE_RIGHT(sibling), 0);
+        treeRotateLeft(parent);
+        node = TREE_ROOT;
+      }
+    } else {
+      sibling = TREE_LEFT(parent);
+      if (TREE_IS_RED(sibling)) {
+        treeSetRed(sibling, 0);
+        treeSetRed(parent, 1);
+        treeRotateRight(parent);
+        sibling = TREE_LEFT(parent);
+      }
+      if (!TREE_IS_RED(TREE_LEFT(sibling)) && !TREE_IS_RED(TREE_RIGHT(sibling))) {
+        treeSetRed(sibling, 1);
+        node = parent;
+        parent = TREE_PARENT(node);
+      } else {
+        if (!TREE_IS_RED(TREE_LEFT(sibling))) {
+          treeSetRed(TREE_RIGHT(sibling), 0);
+          treeSetRed(sibling, 1);
+          treeRotateLeft(sibling);
+          sibling = TREE_LEFT(parent);
+        }
+        treeSetRed(sibling, TREE_IS_RED(parent));
+        treeSetRed(parent, 0);
+        treeSetRed(TREE_LEFT(sibling), 0);
+        treeRotateRight(parent);
+        node = TREE_ROOT;
+      }
+    }
+  }
+  if (node != NULL) {
+    treeSetRed(node, 0);
+  }
+}
+
+/* Unlink 'node' from the tree. */
+static void treeRemove(TreeNode* node) {
+  TreeNode *successor, *child, *parent;
+  int removedRed;
+
+  if (TREE_LEFT(node) == NULL || TREE_RIGHT(node) == NULL) {
+    // At most one child: splice the node out.
+    child = (TREE_LEFT(node) != NULL) ? TREE_LEFT(node) : TREE_RIGHT(node);
+    parent = TREE_PARENT(node);
+    removedRed = TREE_IS_RED(node);
+    treeReplaceChild(node, child);
+    if (child != NULL) {
+      treeSetParent(child, parent);
+    }
+  } else {
+    // Two children: move the in-order successor into node's place.
+    successor = TREE_RIGHT(node);
+    while (TREE_LEFT(successor) != NULL) {
+      successor = TREE_LEFT(successor);
+    }
+    removedRed = TREE_IS_RED(successor);
+    child = TREE_RIGHT(successor);
+    if (TREE_PARENT(successor) == node) {
+      parent = successor;
+    } else {
+      parent = TREE_PARENT(successor);
+      treeReplaceChild(successor, child);
+      if (child != NULL) {
+        treeSetParent(child, parent);
+      }
+      SET_TREE_RIGHT(successor, TREE_RIGHT(node));
+      treeSetParent(TREE_RIGHT(successor), successor);
+    }
+    treeReplaceChild(node, successor);
+    successor->parentAndTags = node->parentAndTags;
+    SET_TREE_LEFT(successor, TREE_LEFT(node));
+    treeSetParent(TREE_LEFT(successor), successor);
+  }
+  if (!removedRed) {
+    treeRemoveFixup(child, parent);
+  }
+}
+
+/* Find the best fitting free block for the requested size: the
+   smallest free block that is at least reqSize bytes.  Returns NULL if
+   no free block is large enough. */
+static void * searchFreeList(size_t reqSize) {
+  size_t size;
+  TreeNode *node, *best = NULL;
+
+  // Small requests first try the exact-size lists.
+  for (size = reqSize; size < TREE_MIN_SIZE; size += ALIGNMENT) {
+    if (SMALL_LIST_HEAD(size) != NULL) {
+      return SMALL_LIST_HEAD(size);
+    }
+  }
+
+  node = TREE_ROOT;
+  while (node != NULL) {
+    size = SIZE(node->info.sizeAndTags);
+    if (size == reqSize) {
+      best = node;
+      break;
+    } else if (size > reqSize) {
+      best = node;
+      node = TREE_LEFT(node);
+    } else {
+      node = TREE_RIGHT(node);
+    }
+  }
+  if (best == NULL) {
+    return NULL;
+  }
+  // Prefer a chained block of the same size: removing it leaves the
+  // tree untouched.
+  return (best->info.next != 0) ? NEXT_FREE(&best->info) : &best->info;
+}
+
+/* Return the largest free block size searchFreeList(reqSize) may have
+   passed over when it returned NULL.  The search is exhaustive, so no
+   free block is as big as reqSize. */
+static size_t searchMissBound(size_t reqSize) {
+  return reqSize - 1;
+}
+
+/* Insert freeBlock into the small list or tree node for its size. */
+static void insertFreeBlock(BlockInfo* freeBlock) {
+  size_t size = SIZE(freeBlock->sizeAndTags);
+  TreeNode *node = (TreeNode *)freeBlock;
+  TreeNode *parent = NULL;
+  TreeNode *child;
+  BlockInfo *oldHead;
+
+  if (size < TREE_MIN_SIZE) {
+    oldHead = SMALL_LIST_HEAD(size);
+    SET_NEXT_FREE(freeBlock, oldHead);
+    if (oldHead != NULL) {
+      SET_PREV_FREE(oldHead, freeBlock);
+    }
+    SET_PREV_FREE(freeBlock, NULL);
+    SMALL_LIST_HEAD(size) = freeBlock;
+    return;
+  }
+
+  for (child = TREE_ROOT; child != NULL; ) {
+    parent = child;
+    if (size == SIZE(parent->info.sizeAndTags)) {
+      // Chain the block right behind the existing node of this size.
+      SET_NEXT_FREE(freeBlock, NEXT_FREE(&parent->info));
+      if (freeBlock->next != 0) {
+        SET_PREV_FREE(NEXT_FREE(freeBlock), freeBlock);
+      }
+      SET_PREV_FREE(freeBlock, &parent->info);
+      SET_NEXT_FREE(&parent->info, freeBlock);
+      node->parentAndTags = 0;
+      return;
+    }
+    child = (size < SIZE(parent->info.sizeAndTags)) ? TREE_LEFT(parent) : TREE_RIGHT(parent);
+  }
+
+  SET_NEXT_FREE(freeBlock, NULL);
+  SET_PREV_FREE(freeBlock, NULL);
+  SET_TREE_LEFT(node, NULL);
+  SET_TREE_RIGHT(node, NULL);
+  node->parentAndTags = PTR_LINK(parent) | TREE_LINKED | TREE_RED;
+  if (parent == NULL) {
+    TREE_ROOT = node;
+  } else if (size < SIZE(parent->info.sizeAndTags)) {
+    SET_TREE_LEFT(parent, node);
+  } else {
+    SET_TREE_RIGHT(parent, node);
+  }
+  treeInsertFixup(node);
+}
+
+/* Remove a free block from its small list, chain or the tree.  The
+   block's size must not have changed since it was inserted. */
+static void removeFreeBlock(BlockInfo* freeBlock) {
+  size_t size = SIZE(freeBlock->sizeAndTags);
+  TreeNode *node = (TreeNode *)freeBlock;
+  TreeNode *heir;
+  BlockInfo *nextFree = NEXT_FREE(freeBlock);
+  BlockInfo *prevFree = PREV_FREE(freeBlock);
+
+#if PURGE_MIN_SIZE > 0
+  forgetPurgeCandidate(freeBlock);
+#endif
+  if (size < TREE_MIN_SIZE) {
+    if (nextFree != NULL) {
+      SET_PREV_FREE(nextFree, prevFree);
+    }
+    if (prevFree == NULL) {
+      SMALL_LIST_HEAD(size) = nextFree;
+    } else {
+      SET_NEXT_FREE(prevFree, nextFree);
+    }
+    return;
+  }
+
+  if ((node->parentAndTags & TREE_LINKED) == 0) {
+    // A chained block: just unlink it from the chain.
+    SET_NEXT_FREE(prevFree, nextFree);
+    if (nextFree != NULL) {
+      SET_PREV_FREE(nextFree, prevFree);
+    }
+  } else if (nextFree != NULL) {
+    // A tree node with a chain: the next block of the same size takes
+    // over its place in the tree, so no rebalancing is needed.
+    heir = (TreeNode *)nextFree;
+    SET_TREE_LEFT(heir, TREE_LEFT(node));
+    SET_TREE_RIGHT(heir, TREE_RIGHT(node));
+    heir->parentAndTags = node->parentAndTags;
+    SET_PREV_FREE(nextFree, NULL);
+    treeReplaceChild(node, heir);
+    if (TREE_LEFT(heir) != NULL) {
+      treeSetParent(TREE_LEFT(heir), heir);
+    }
+    if (TREE_RIGHT(heir) != NULL) {
+      treeSetParent(TREE_RIGHT(heir), heir);
+    }
+  } else {
+    treeRemove(node);
+  }
+}
+
+#endif /* FREE_INDEX */
+
+/* Coalesce 'oldBlock' with any preceeding or following free blocks. */
+static void coalesceFreeBlock(BlockInfo* oldBlock) {
+  BlockInfo *blockCursor;
+  BlockInfo *newBlock;
+  BlockInfo *freeBlock;
+  // size of old block
+  size_t oldSize = SIZE(oldBlock->sizeAndTags);
+  // running sum to be size of final coalesced block
+  size_t newSize = oldSize;
+
+  // Coalesce with any preceding free block
+  blockCursor = oldBlock;
+  while ((blockCursor->sizeAndTags & TAG_PRECEDING_USED)==0) { 
+    // While the block preceding this one in memory (not the
+    // prev. block in the free list) is free:
+    //
+    // Get the size of the previous block from its boundary tag.
+    size_t size = SIZE(*((Tag*)UNSCALED_POINTER_SUB(blockCursor, HEADER_SIZE)));
+    // Use this size to find the block info for that block.
+    freeBlock = (BlockInfo*)UNSCALED_POINTER_SUB(blockCursor, size);
+    // Remove that block from free list.
+
+    removeFreeBlock(freeBlock);
+
+    // Count that block's size and update the current block pointer.
+    newSize += size;
+    blockCursor = freeBlock;
+
+  }
+  newBlock = blockCursor;
+  
+  // Coalesce with any following free block.
+  // Start with the block following this one in memory
+  blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(oldBlock, oldSize);
+  while ((blockCursor->sizeAndTags & TAG_USED)==0) {
+    // While the block is free:
+    size_t size = SIZE(blockCursor->sizeAndTags);
+    // Remove it from the free list.
+    removeFreeBlock(blockCursor);
+    // Count its size and step to the following block.
+    newSize += size;
+    blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(blockCursor, size);
+  }
+  
+  // If the block actually grew, remove the old entry from the free
+  // list and add the new entry.
+  if (newSize != oldSize) {
+    // Remove the original block from the free list
+    removeFreeBlock(oldBlock);
+
+    // Save the new size in the block info and in the boundary tag
+    // and tag it to show the preceding block is used (otherwise, it
+    // would have become part of this one!).
+    newBlock->sizeAndTags = newSize | TAG_PRECEDING_USED;
+    // The boundary tag of the preceding block is the word immediately
+    // preceding block in memory where we left off advancing blockCursor.
+    *(Tag*)UNSCALED_POINTER_SUB(blockCursor, HEADER_SIZE) = newSize | TAG_PRECEDING_USED;  
+    // Put the new block in the free list.
+    insertFreeBlock(newBlock);
+    
+  }
+  if (newSize > curArena->maxFreeSize) {
+    curArena->maxFreeSize = newSize;
+  }
+#if PURGE_MIN_SIZE > 0
+  trackPurgeCandidate(newBlock, NULL);
+#endif
+  return;
+}
+
+/* Serializes growth and trimming of the arenas, so that where new space
+   will start (and so whether it extends an arena's newest segment, and
+   how much padding aligns it) is known before mem_sbrk is called, and
+   an arena only trims space that is still at the top of the heap. */
+static pthread_mutex_t growLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Non-main arenas grow by at least this much at a time (a multiple of
+   CHUNK_SIZE). */
+#define ARENA_GROW_SIZE (16 * CHUNK_SIZE)
+
+/* An arena that has to grow again within GROW_BURST allocations of its
+   last growth doubles its growth step, so that a run of growth takes a
+   few large mem_sbrk calls instead of many small ones; an arena that
+   went longer drops back to the smallest step.  The step stays below
+   GROW_MAX_SIZE and 1/GROW_HEAP_FRACTION of the heap, which bounds the
+   space left unused at the top of the heap. */
+#define GROW_BURST 16
+#define GROW_MAX_SIZE (64 * CHUNK_SIZE)
+#define GROW_HEAP_FRACTION 64
+
+static int setChunkInfo(void* chunk, unsigned int info);
+
+static void freeBlock(BlockInfo* blockInfo);
+
+/* Make top, whose header the caller has written, the top chunk of the
+   current arena.  Its header is never untouched. */
+static void setTop(BlockInfo* top) {
+  char *payload = (char *)UNSCALED_POINTER_ADD(top, HEADER_SIZE);
+
+  curArena->top = top;
+  if (curArena->untouched < payload) {
+    curArena->untouched = payload;
+  }
+}
+
+/* Get more heap space for the current arena, so that its top chunk
+   holds at least reqSize bytes.  If the new space extends the top
+   chunk, only the shortfall is requested.  With inPlace set, space is
+   only taken if it extends the top chunk.  Returns whether the arena
+   got more space. */
+static int requestMoreSpace(size_t reqSize, int inPlace) {
+  Arena *arena = curArena;
+  size_t pagesize = mem_pagesize();
+  size_t granule = arena->id == 0 ? pagesize : CHUNK_SIZE;
+  size_t minGrowSize = arena->id == 0 ? pagesize : ARENA_GROW_SIZE;
+  char *clean;
+  size_t wilderness;
+  BlockInfo *top;
+  size_t totalSize;
+  size_t prologueSize = 0;
+  size_t gap = 0;
+  size_t chunk;
+  char *brk;
+  char *segment;
+  void* mem_sbrk_result;
+  int contiguous;
+
+  pthread_mutex_lock(&growLock);
+  brk = (char *)mem_heap_hi() + 1;
+  contiguous = arena->epilogue != NULL &&
+    brk == (char *)UNSCALED_POINTER_ADD(arena->epilogue, HEADER_SIZE);
+  if (inPlace && !contiguous) {
+    pthread_mutex_unlock(&growLock);
+    return 0;
+  }
+
+  if (arena->growSize == 0 || arena->allocCount - arena->lastGrowth > GROW_BURST) {
+    arena->growSize = minGrowSize;
+  } else if (arena->growSize < GROW_MAX_SIZE &&
+             arena->growSize < mem_heapsize() / GROW_HEAP_FRACTION) {
+    arena->growSize *= 2;
+  }
+  arena->lastGrowth = arena->allocCount;
+
+  if (contiguous) {
+    // The new space will extend the top chunk, so the whole granules it
+    // already provides need not be asked for again.
+    wilderness = SIZE(arena->top->sizeAndTags);
+    wilderness -= wilderness % granule;
+    reqSize = (reqSize + granule - 1) / granule * granule;
+    reqSize = reqSize > wilderness ? reqSize - wilderness : 0;
+  } else {
+    // A new segment needs a prologue and an epilogue, and must start
+    // on a chunk boundary unless it belongs to the main arena.
+    prologueSize = arena->epilogue == NULL ? HEAP_PROLOGUE_SIZE
+      : HEAP_PROLOGUE_SIZE - HEAP_INDEX_SIZE;
+    reqSize += prologueSize + HEADER_SIZE;
+    if (arena->id != 0) {
+      gap = -(uintptr_t)brk & (CHUNK_SIZE - 1);
+    }
+  }
+  if (reqSize < arena->growSize) {
+    reqSize = arena->growSize;
+  }
+  totalSize = (reqSize + granule - 1) / granule * granule;
+#ifdef MM_COMPACT
+  // Compact links and tags cannot reach past 4 GB from the heap start.
+  if (mem_heapsize() + gap + totalSize > (size_t)UINT32_MAX) {
+    printf("ERROR: compact heap would exceed 4 GB in requestMoreSpace\n");
+    exit(0);
+  }
+#endif
+  clean = (char *)mem_clean_lo();
+  mem_sbrk_result = mem_sbrk(gap + totalSize);
+  pthread_mutex_unlock(&growLock);
+  if ((size_t)mem_sbrk_result == -1) {
+    printf("ERROR: mem_sbrk failed in requestMoreSpace\n");
+    exit(0);
+  }
+  segment = (char *)mem_sbrk_result + gap;
+
+  if (contiguous) {
+    // The old epilogue word is now inside the top chunk, and must read
+    // as zero again if the untouched space is to run on past it.  The
+    // new space is untouched only from where memlib says so.
+    top = arena->top;
+    top->sizeAndTags += totalSize;
+    if (clean > brk) {
+      if (arena->untouched < clean) {
+        arena->untouched = clean;
+      }
+    } else if (arena->untouched <= (char *)arena->epilogue) {
+      *arena->epilogue = 0;
+    }
+  } else {
+    if (arena->epilogue == NULL) {
+#if FREE_INDEX != FREE_INDEX_TLSF
+      arena->prologue = segment;
+#endif
+      initFreeIndex();
+    } else if (SIZE(arena->top->sizeAndTags) >= MIN_BLOCK_SIZE) {
+      // The old top chunk becomes an ordinary free block.
+      top = arena->top;
+      arena->top = NULL;
+      freeBlock(top);
+    }
+    // Nothing before the segment may be coalesced with.
+    top = (BlockInfo*)UNSCALED_POINTER_ADD(segment, prologueSize);
+    top->sizeAndTags = (totalSize - prologueSize - HEADER_SIZE) | TAG_PRECEDING_USED | TAG_USED;
+    arena->untouched = clean;
+    setTop(top);
+  }
+
+  /* initialize "new" useless last word
+     the top chunk is tagged used, and so is this word
+     This trick lets us do the "normal" check even at the end of
+     the heap and avoid a special check to see if the following
+     block is the end of the heap... */
+  arena->epilogue = (Tag*)UNSCALED_POINTER_ADD(top, SIZE(top->sizeAndTags));
+  *arena->epilogue = TAG_PRECEDING_USED | TAG_USED;
+
+  // Chunks nobody claims belong to the main arena; claim the others'.
+  if (arena->id != 0) {
+    for (chunk = 0; chunk < totalSize; chunk += CHUNK_SIZE) {
+      if (!setChunkInfo(segment + chunk, arena->id)) {
+        printf("ERROR: heap outgrew the chunk map in requestMoreSpace\n");
+        exit(0);
+      }
+    }
+  }
+  return 1;
+}
+
+
+/* A top chunk that grows past TRIM_THRESHOLD bytes at the top of the
+   heap is given back to memlib down to about TRIM_THRESHOLD / 2 bytes,
+   so that the heap follows the live data down after a burst of large
+   blocks is freed.  The gap between the two keeps a heap that shrinks
+   and regrows by a little from trimming and growing every time.
+   0 disables trimming. */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+
+#if TRIM_THRESHOLD > 0
+/* Give back the space at the end of the current arena's top chunk, if
+   the top chunk is too big and still ends at the top of the heap. */
+static void trimTop() {
+  Arena *arena = curArena;
+  size_t granule = arena->id == 0 ? mem_pagesize() : CHUNK_SIZE;
+  size_t release = SIZE(arena->top->sizeAndTags) - TRIM_THRESHOLD / 2;
+  char *end = (char *)UNSCALED_POINTER_ADD(arena->epilogue, HEADER_SIZE);
+  char *clean;
+  size_t chunk;
+
+  release -= release % granule;
+  pthread_mutex_lock(&growLock);
+  if (end != (char *)mem_heap_hi() + 1) {
+    pthread_mutex_unlock(&growLock);
+    return;
+  }
+  // Whoever gets these chunks next claims them anew; chunks nobody
+  // claims belong to the main arena.
+  if (arena->id != 0) {
+    for (chunk = CHUNK_SIZE; chunk <= release; chunk += CHUNK_SIZE) {
+      setChunkInfo(end - chunk, 0);
+    }
+  }
+  mem_trim(release);
+  clean = (char *)mem_clean_lo();
+  pthread_mutex_unlock(&growLock);
+  arena->top->sizeAndTags -= release;
+  arena->epilogue = (Tag*)UNSCALED_POINTER_SUB(arena->epilogue, release);
+  *arena->epilogue = TAG_PRECEDING_USED | TAG_USED;
+  // Past the new end, memlib knows best what still reads as zero.
+  if (arena->untouched > (char *)arena->epilogue) {
+    arena->untouched = clean;
+  }
+}
+#endif
+
+/* Return the block size (header included) needed for a payload of
+   size bytes. */
+static size_t blockSizeFor(size_t size) {
+  // Add one word for the initial size header.
+  // Note that we don't need to boundary tag when the block is used!
+  size += HEADER_SIZE;
+  if (size <= MIN_BLOCK_SIZE) {
+    // Make sure we allocate enough space for a blockInfo in case we
+    // free this block (when we free this block, we'll need to use the
+    // next pointer, the prev pointer, and the boundary tag).
+    return MIN_BLOCK_SIZE;
   } else {
     // Round up for correct alignment
-    reqSize = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
-  }
-
-  // Implement mm_malloc.  You can change or remove any of the above
-  // code.  It is included as a suggestion of where to start.
-  // You will want to replace this return statement...
-  // printf("reqSize: %ld\n", reqSize);
-  AfterRequestMoreSpace:
-  if ((ptrFreeBlock = searchFreeList(reqSize)) != NULL)
-  { 
-    // printf("ptrFreeBlock: %p\n", ptrFreeBlock);
-    // examine_heap();
-    /*keep the info of the following block*/
-    followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, SIZE(ptrFreeBlock->sizeAndTags));
-    // printf("followingBlock: %p\n", followingBlock);
-    oldSize = SIZE(ptrFreeBlock->sizeAndTags);
-    // printf("oldSize: %ld\n", oldSize);
-    if ((oldSize - reqSize) >= MIN_BLOCK_SIZE)
-    {
-      // printf("Separate block\n");
-      //newBlock header
-      newBlock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize);
-      // printf("newBlock: %p\n",newBlock);
-      newBlock->sizeAndTags = (oldSize - reqSize) | TAG_PRECEDING_USED;
-      // examine_heap();
-      //newBlock->prev = NULL;
-      // printf("new size: %ld\n", oldSize - reqSize);
-
-      //boundary tag
-      *((size_t*)UNSCALED_POINTER_ADD(newBlock, SIZE(newBlock->sizeAndTags) - WORD_SIZE)) = newBlock->sizeAndTags;
-      //examine_heap();
-
-      // printf("insert newBlock: %p\n",newBlock);
-      precedingBlockUseTag = (ptrFreeBlock->sizeAndTags) & TAG_PRECEDING_USED;
-      ptrFreeBlock->sizeAndTags = reqSize | precedingBlockUseTag;
-      insertFreeBlock(newBlock);
-      // examine_heap();
-      // printf("insert completed\n");
-      
-      //Save the status of PRECEDING block
-      precedingBlockUseTag = (ptrFreeBlock->sizeAndTags) & TAG_PRECEDING_USED;
-      //change size to current request, keep both tag
-      ptrFreeBlock->sizeAndTags |= TAG_USED;
-      
+    return ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+  }
+}
+
+#if QUICK_LISTS > 0
+static BlockInfo* popQuickList(size_t reqSize);
+static void consolidateQuickLists();
+#endif
+static BlockInfo* useFreeBlock(BlockInfo* ptrFreeBlock, size_t reqSize);
+
+/* Carve a used block of reqSize bytes off the front of the top chunk,
+   growing the arena first if the top chunk is too small. */
+static BlockInfo* allocFromTop(size_t reqSize) {
+  BlockInfo *block;
+  BlockInfo *top;
+
+  while (curArena->top == NULL || SIZE(curArena->top->sizeAndTags) < reqSize) {
+    requestMoreSpace(reqSize, 0);
+  }
+  block = curArena->top;
+  top = (BlockInfo*)UNSCALED_POINTER_ADD(block, reqSize);
+  // When the top chunk is used up, this writes the epilogue word.
+  top->sizeAndTags = (SIZE(block->sizeAndTags) - reqSize) | TAG_PRECEDING_USED | TAG_USED;
+  block->sizeAndTags = reqSize | (block->sizeAndTags & TAG_PRECEDING_USED) | TAG_USED;
+  curArena->carvedUntouched = (char *)UNSCALED_POINTER_ADD(block, HEADER_SIZE) >= curArena->untouched;
+  setTop(top);
+  return block;
+}
+
+/* Lower the current arena's bound on its largest free block after
+   searchFreeList(reqSize) found no block, to what the search rules
+   out. */
+static void lowerMaxFreeSize(size_t reqSize) {
+  size_t bound = searchMissBound(reqSize);
+
+  if (bound < curArena->maxFreeSize) {
+    curArena->maxFreeSize = bound;
+  }
+}
+
+/* Take a free block of at least reqSize bytes (a block size from
+   blockSizeFor()) out of the free lists, or carve it off the top chunk
+   if none is big enough, mark it used and return it.  Any excess large
+   enough to be a block of its own is split off and stays free. */
+static BlockInfo* allocBlock(size_t reqSize) {
+  BlockInfo * ptrFreeBlock = NULL;
+
+#if QUICK_LISTS > 0
+  // A block of exactly this size freed recently is reused as is;
+  // otherwise every parked block is merged back first.
+  if ((ptrFreeBlock = popQuickList(reqSize)) != NULL) {
+    return ptrFreeBlock;
+  }
+  consolidateQuickLists();
+#endif
+
+  curArena->allocCount++;
+#if PURGE_MIN_SIZE > 0
+  if (curArena->purgeCount > 0 && curArena->allocCount % PURGE_CHECK_INTERVAL == 0) {
+    purgeArena(0);
+  }
+#endif
+  // Fresh space is handed out without touching the free index, which is
+  // only searched if it may hold a big enough block.  (This also keeps
+  // the index of an arena without a segment from being searched.)
+  if (reqSize <= curArena->maxFreeSize) {
+    ptrFreeBlock = searchFreeList(reqSize);
+    if (ptrFreeBlock == NULL) {
+      lowerMaxFreeSize(reqSize);
     }
-    else
-    {
-      //no block is needed to add to list
-      ptrFreeBlock->sizeAndTags |= TAG_USED;
-      followingBlock->sizeAndTags |= TAG_PRECEDING_USED;
+  }
+  if (ptrFreeBlock == NULL) {
+    return allocFromTop(reqSize);
+  }
+  return useFreeBlock(ptrFreeBlock, reqSize);
+}
+
+/* Take the free block ptrFreeBlock, of at least reqSize bytes, out of
+   the free index and mark it used.  Any excess large enough to be a
+   block of its own is split off and stays free. */
+static BlockInfo* useFreeBlock(BlockInfo* ptrFreeBlock, size_t reqSize) {
+  size_t precedingBlockUseTag;
+  size_t oldSize;
+  BlockInfo * newBlock = NULL;
+  BlockInfo * followingBlock;
+#if PURGE_MIN_SIZE > 0
+  PurgeCandidate *candidate = NULL;
+  PurgeCandidate split;
+#endif
+
+#if PURGE_MIN_SIZE > 0
+  if ((candidate = findPurgeCandidate(ptrFreeBlock)) != NULL) {
+    split = *candidate;
+    noteRefaults(&split, reqSize);
+  }
+#endif
+  // Unlink it while its size still names the list it is in.
+  removeFreeBlock(ptrFreeBlock);
+  /*keep the info of the following block*/
+  followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, SIZE(ptrFreeBlock->sizeAndTags));
+  oldSize = SIZE(ptrFreeBlock->sizeAndTags);
+  if ((oldSize - reqSize) >= MIN_BLOCK_SIZE)
+  {
+    //newBlock header
+    newBlock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize);
+    newBlock->sizeAndTags = (oldSize - reqSize) | TAG_PRECEDING_USED;
+
+    //boundary tag
+    *((Tag*)UNSCALED_POINTER_ADD(newBlock, SIZE(newBlock->sizeAndTags) - HEADER_SIZE)) = newBlock->sizeAndTags;
+
+    //Save the status of PRECEDING block
+    precedingBlockUseTag = (ptrFreeBlock->sizeAndTags) & TAG_PRECEDING_USED;
+    //change size to current request, keep both tag
+    ptrFreeBlock->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED;
+    insertFreeBlock(newBlock);
+#if PURGE_MIN_SIZE > 0
+    // The rest of a candidate stays one.
+    if (candidate != NULL) {
+      trackPurgeCandidate(newBlock, &split);
+    }
+#endif
+  }
+  else
+  {
+    //no block is needed to add to list
+    ptrFreeBlock->sizeAndTags |= TAG_USED;
+    followingBlock->sizeAndTags |= TAG_PRECEDING_USED;
+  }
+  return ptrFreeBlock;
+}
+
+/* Merge the used block blockInfo, which precedes the top chunk, and a
+   free block before it into the top chunk. */
+static void mergeIntoTop(BlockInfo* blockInfo) {
+  size_t size = SIZE(blockInfo->sizeAndTags) + SIZE(curArena->top->sizeAndTags);
+  BlockInfo *preceding;
+
+  if ((blockInfo->sizeAndTags & TAG_PRECEDING_USED) == 0) {
+    preceding = (BlockInfo*)UNSCALED_POINTER_SUB(blockInfo,
+      SIZE(*(Tag*)UNSCALED_POINTER_SUB(blockInfo, HEADER_SIZE)));
+    removeFreeBlock(preceding);
+    size += SIZE(preceding->sizeAndTags);
+    blockInfo = preceding;
+  }
+  // Free blocks are always coalesced, so whatever precedes is used.
+  blockInfo->sizeAndTags = size | TAG_PRECEDING_USED | TAG_USED;
+  setTop(blockInfo);
+#if TRIM_THRESHOLD > 0
+  if (size > TRIM_THRESHOLD) {
+    trimTop();
+  }
+#endif
+}
+
+/* Mark the used block blockInfo free, put it in the free lists and
+   coalesce it with its free neighbors. */
+static void freeBlock(BlockInfo* blockInfo) {
+  BlockInfo * followingBlock;
+
+  if (UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->sizeAndTags)) == (void*)curArena->top) {
+    mergeIntoTop(blockInfo);
+    return;
+  }
+  blockInfo->sizeAndTags &= ~(TAG_USED | TAG_GROWN);
+  // set boundary tag
+  *((Tag*)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->sizeAndTags) - HEADER_SIZE)) = blockInfo->sizeAndTags;
+  /*keep the info of the following block*/
+  followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->sizeAndTags));
+  // Clear its preceding-used bit.
+  followingBlock->sizeAndTags &= ~TAG_PRECEDING_USED;
+  // if the following block is in the list, keep its boundary tag in sync
+  if ((followingBlock->sizeAndTags & TAG_USED) == 0)
+  {
+    *((Tag*)UNSCALED_POINTER_ADD(followingBlock, SIZE(followingBlock->sizeAndTags) - HEADER_SIZE)) = followingBlock->sizeAndTags;
+  }
+  insertFreeBlock(blockInfo);
+  coalesceFreeBlock(blockInfo);
+}
+
+/******** QUICK-LISTS ************************************************/
+
+
+/* Blocks freed through mm_free are not coalesced at once: each arena
+   parks them, still tagged used, on exact-size quick-lists, so that a
+   malloc of the same size that follows (the common alloc/free
+   ping-pong) is a pop instead of a split, and the free a push instead
+   of a coalesce.  Quick-list i holds blocks of one size whose
+   ALIGNMENT-unit count is i modulo QUICK_LISTS, claimed by whichever
+   such size is freed while the list is empty; blocks of other sizes
+   are freed normally.  Any allocation that the quick-lists cannot
+   serve first hands every parked block to freeBlock(), which merges
+   it with its neighbors, so no space is ever requested from memlib
+   while freed space is parked. */
+#if QUICK_LISTS > 0
+
+#define QUICK_LIST(size) (&curArena->quick[((size) / ALIGNMENT) % QUICK_LISTS])
+
+/* Park the used block on its quick-list.  Returns 0 if the list holds
+   blocks of another size. */
+static int pushQuickList(BlockInfo* block) {
+  size_t size = SIZE(block->sizeAndTags);
+  QuickList *quick = QUICK_LIST(size);
+
+  if (quick->head == NULL) {
+    quick->size = size;
+  } else if (quick->size != size) {
+    return 0;
+  }
+  block->sizeAndTags &= ~TAG_GROWN;
+  SET_NEXT_FREE(block, quick->head);
+  quick->head = block;
+  curArena->quickCount++;
+  return 1;
+}
+
+/* Take a parked block of exactly reqSize bytes, or return NULL. */
+static BlockInfo* popQuickList(size_t reqSize) {
+  QuickList *quick = QUICK_LIST(reqSize);
+  BlockInfo *block = quick->head;
+
+  if (block == NULL || quick->size != reqSize) {
+    return NULL;
+  }
+  quick->head = NEXT_FREE(block);
+  curArena->quickCount--;
+  return block;
+}
+
+/* Free and coalesce every parked block of the current arena. */
+static void consolidateQuickLists() {
+  BlockInfo *block;
+  int i;
+
+  for (i = 0; curArena->quickCount > 0 && i < QUICK_LISTS; i++) {
+    while ((block = curArena->quick[i].head) != NULL) {
+      curArena->quick[i].head = NEXT_FREE(block);
+      curArena->quickCount--;
+      freeBlock(block);
+    }
+  }
+}
+
+#endif /* QUICK_LISTS */
+
+/* Shrink the used block to newSize bytes, freeing the tail if it is big
+   enough to be a block of its own. */
+static void trimUsedBlock(BlockInfo* block, size_t newSize) {
+  size_t oldSize = SIZE(block->sizeAndTags);
+  BlockInfo *tail;
+
+  if (oldSize - newSize < MIN_BLOCK_SIZE) {
+    return;
+  }
+  block->sizeAndTags = newSize | (block->sizeAndTags & (TAG_USED | TAG_PRECEDING_USED | TAG_GROWN));
+  // Make the tail a used block of its own, then free it.
+  tail = (BlockInfo*)UNSCALED_POINTER_ADD(block, newSize);
+  tail->sizeAndTags = (oldSize - newSize) | TAG_PRECEDING_USED | TAG_USED;
+  freeBlock(tail);
+}
+
+/* Allocate a used block whose payload of size bytes starts at a
+   multiple of align (a power of two no smaller than ALIGNMENT).  The
+   misaligned space in front of the payload is split off as a free
+   block instead of being wasted. */
+static BlockInfo* allocAlignedBlock(size_t align, size_t size) {
+  size_t reqSize = blockSizeFor(size);
+  BlockInfo *block = allocBlock(reqSize + align + MIN_BLOCK_SIZE);
+  char *payload = (char *)UNSCALED_POINTER_ADD(block, HEADER_SIZE);
+  char *aligned = (char *)(((uintptr_t)payload + align - 1) & ~(uintptr_t)(align - 1));
+  BlockInfo *alignedBlock;
+  size_t leadSize;
+
+  if (aligned != payload) {
+    // The leading piece must be able to stand as a free block, which
+    // takes more than one step when align is below MIN_BLOCK_SIZE.
+    while ((size_t)(aligned - payload) < MIN_BLOCK_SIZE) {
+      aligned += align;
+    }
+    leadSize = aligned - payload;
+    alignedBlock = (BlockInfo*)UNSCALED_POINTER_SUB(aligned, HEADER_SIZE);
+    alignedBlock->sizeAndTags = (SIZE(block->sizeAndTags) - leadSize) | TAG_USED;
+    block->sizeAndTags = leadSize | (block->sizeAndTags & TAG_PRECEDING_USED);
+    *((Tag*)UNSCALED_POINTER_ADD(block, leadSize - HEADER_SIZE)) = block->sizeAndTags;
+    insertFreeBlock(block);
+    coalesceFreeBlock(block);
+    block = alignedBlock;
+  }
+  trimUsedBlock(block, reqSize);
+  return block;
+}
+
+
+/******** CHUNK MAP **************************************************/
+
+
+/* For every CHUNK_SIZE-aligned chunk of the heap, the chunk map keeps a
+   byte holding the id of the arena that claimed it (0, the main arena,
+   if none did) and CHUNK_SLAB if the chunk is a slab.  It has two
+   levels: chunkMap[i] covers CHUNK_MAP_LEAF_SIZE chunks and is
+   allocated from the heap the first time one of them is recorded.
+
+   mm_free reads the map without any lock, so leaves are published with
+   release/acquire ordering.  A chunk's byte is written only by the
+   holder of its arena's lock and cannot change while the reader owns
+   memory in the chunk. */
+#define CHUNK_SLAB 0x80
+#define CHUNK_ARENA_MASK 0x7f
+
+#define CHUNK_MAP_LEAF_BITS 9
+#define CHUNK_MAP_LEAF_SIZE (1 << CHUNK_MAP_LEAF_BITS)
+#define CHUNK_MAP_ROOT_SIZE 8192
+static unsigned char* chunkMap[CHUNK_MAP_ROOT_SIZE];
+
+/* Address of chunk 0 of the chunk map. */
+static uintptr_t chunkMapBase;
+
+/* Forget everything recorded in the map; used by mm_init. */
+static void initChunkMap() {
+  memset(chunkMap, 0, sizeof(chunkMap));
+  chunkMapBase = (uintptr_t)heapBase & ~(uintptr_t)(CHUNK_SIZE - 1);
+}
+
+/* The map byte of the chunk holding ptr. */
+static unsigned int chunkInfo(void* ptr) {
+  size_t chunk = ((uintptr_t)ptr - chunkMapBase) / CHUNK_SIZE;
+  unsigned char *leaf;
+
+  if ((chunk >> CHUNK_MAP_LEAF_BITS) >= CHUNK_MAP_ROOT_SIZE) {
+    return 0;
+  }
+  leaf = __atomic_load_n(&chunkMap[chunk >> CHUNK_MAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+  if (leaf == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&leaf[chunk & (CHUNK_MAP_LEAF_SIZE - 1)], __ATOMIC_RELAXED);
+}
+
+/* Set the map byte of the chunk starting at 'chunk'.  Returns 0 if the
+   map does not reach that far. */
+static int setChunkInfo(void* chunk, unsigned int info) {
+  size_t index = ((uintptr_t)chunk - chunkMapBase) / CHUNK_SIZE;
+  unsigned char **root;
+  unsigned char *leaf;
+  unsigned char *newLeaf;
+
+  if ((index >> CHUNK_MAP_LEAF_BITS) >= CHUNK_MAP_ROOT_SIZE) {
+    return 0;
+  }
+  root = &chunkMap[index >> CHUNK_MAP_LEAF_BITS];
+  leaf = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+  if (leaf == NULL) {
+    newLeaf = (unsigned char *)&(allocBlock(blockSizeFor(CHUNK_MAP_LEAF_SIZE))->next);
+    memset(newLeaf, 0, CHUNK_MAP_LEAF_SIZE);
+    if (__atomic_compare_exchange_n(root, &leaf, newLeaf, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      leaf = newLeaf;
+    } else {
+      // Another arena published this leaf first.
+      freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(newLeaf, HEADER_SIZE));
+    }
+  }
+  __atomic_store_n(&leaf[index & (CHUNK_MAP_LEAF_SIZE - 1)], info, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* The arena a block or slab object belongs to. */
+static Arena* arenaOf(void* ptr) {
+  return &arenas[chunkInfo(ptr) & CHUNK_ARENA_MASK];
+}
+
+
+/******** SLAB ALLOCATOR FOR SMALL REQUESTS **************************/
+
+
+/* Requests of at most SLAB_MAX_SIZE bytes are served from slabs:
+   SLAB_SIZE-aligned blocks, each dedicated to one size class (a
+   multiple of ALIGNMENT), holding objects with no header at all.
+   The size class of an object is read from the Slab header at the
+   start of the slab, found by masking the object's address.  Build
+   with -DSLAB_MAX_SIZE=0 to send every request to the free lists. */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 128
+#endif
+
+#if SLAB_MAX_SIZE > 0
+
+/* Size (and alignment) of a slab: one chunk, so that the chunk map can
+   record which chunks are slabs. */
+#define SLAB_SIZE CHUNK_SIZE
+
+/* Number of slab size classes; class c holds objects of
+   (c + 1) * ALIGNMENT bytes. */
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_CLASS(size) (((size) - 1) / ALIGNMENT)
+
+/* The header at the start of each slab. */
+struct Slab {
+  // Neighbors in the list of slabs of this class with free objects.
+  struct Slab* next;
+  struct Slab* prev;
+  // Objects freed back to this slab, linked through their first word.
+  void* freeObjects;
+  // First object never handed out.  Objects from here to the end of
+  // the slab are handed out in order, so a new slab is never walked.
+  char* untouched;
+  unsigned int objSize;
+  unsigned int numObjs;
+  unsigned int numFree;
+};
+typedef struct Slab Slab;
+
+#define SLAB_HEADER_SIZE \
+  ((sizeof(Slab) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* The slab an object lives in. */
+#define SLAB_OF(ptr) ((Slab *)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+/* Slabs with at least one free object, per arena and class. */
+static Slab* slabPartial[NUM_ARENAS][NUM_SLAB_CLASSES];
+
+/* The partial list of class 'class' in the current arena. */
+#define SLAB_PARTIAL(class) (slabPartial[curArena->id][class])
+
+/* Forget every slab; used by mm_init. */
+static void initSlabs() {
+  memset(slabPartial, 0, sizeof(slabPartial));
+}
+
+/* Is ptr an object in a slab (rather than the payload of a block)? */
+static int isSlabObject(void* ptr) {
+  return (chunkInfo(ptr) & CHUNK_SLAB) != 0;
+}
+
+/* Carve a new, empty slab for size class 'class' out of the heap and
+   make it the head of the class's partial list. */
+static Slab* newSlab(int class) {
+  BlockInfo *block = allocAlignedBlock(SLAB_SIZE, SLAB_SIZE);
+  Slab *slab = (Slab *)&(block->next);
+
+  if (!setChunkInfo(slab, curArena->id | CHUNK_SLAB)) {
+    freeBlock(block);
+    return NULL;
+  }
+  slab->objSize = (class + 1) * ALIGNMENT;
+  slab->numObjs = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->objSize;
+  slab->numFree = slab->numObjs;
+  slab->freeObjects = NULL;
+  slab->untouched = (char *)UNSCALED_POINTER_ADD(slab, SLAB_HEADER_SIZE);
+  slab->prev = NULL;
+  slab->next = NULL;
+  SLAB_PARTIAL(class) = slab;
+  return slab;
+}
+
+/* Unlink slab from the partial list of its class. */
+static void unlinkSlab(Slab* slab, int class) {
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    SLAB_PARTIAL(class) = slab->next;
+  }
+}
+
+/* Hand out an object of at least size bytes (size <= SLAB_MAX_SIZE).
+   Returns NULL if no slab could be made. */
+static void* slabAlloc(size_t size) {
+  int class = SLAB_CLASS(size);
+  Slab *slab = SLAB_PARTIAL(class);
+  void *obj;
+
+  if (slab == NULL && (slab = newSlab(class)) == NULL) {
+    return NULL;
+  }
+  if (slab->freeObjects != NULL) {
+    obj = slab->freeObjects;
+    slab->freeObjects = *(void **)obj;
+  } else {
+    obj = slab->untouched;
+    slab->untouched += slab->objSize;
+  }
+  // A full slab leaves the partial list until an object comes back.
+  if (--slab->numFree == 0) {
+    unlinkSlab(slab, class);
+  }
+  return obj;
+}
+
+/* Return an object to its slab.  A slab that becomes empty goes back
+   to the heap, unless it is the only slab of its class with room (so
+   that a malloc/free ping-pong does not make a slab each time). */
+static void slabFree(void* obj) {
+  Slab *slab = SLAB_OF(obj);
+  int class = SLAB_CLASS(slab->objSize);
+
+  *(void **)obj = slab->freeObjects;
+  slab->freeObjects = obj;
+  if (slab->numFree++ == 0) {
+    slab->prev = NULL;
+    slab->next = SLAB_PARTIAL(class);
+    if (slab->next != NULL) {
+      slab->next->prev = slab;
+    }
+    SLAB_PARTIAL(class) = slab;
+  }
+  if (slab->numFree == slab->numObjs &&
+      (slab->prev != NULL || slab->next != NULL)) {
+    unlinkSlab(slab, class);
+    setChunkInfo(slab, curArena->id);
+    freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(slab, HEADER_SIZE));
+  }
+}
+
+#endif /* SLAB_MAX_SIZE */
+
+
+/******** DIRECT MAPPINGS ********************************************/
+
+
+/* Requests of at least MMAP_THRESHOLD bytes get a page-aligned mapping
+   of their own from memlib, outside the boundary-tag heap, so that
+   freeing one leaves no hole: mm_free unmaps it, and mm_realloc resizes
+   it with mem_remap, which moves pages instead of copying them.  The
+   mapping starts with its length, and the payload with a TAG_MAPPED
+   header, MAPPED_HEADER_SIZE bytes into it.  Mapped
+   blocks belong to no arena.  0 disables direct mappings. */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+#if MMAP_THRESHOLD > 0
+
+#define MAPPED_HEADER_SIZE (2 * sizeof(size_t))
+
+/* The length of the mapping needed for a payload of size bytes. */
+static size_t mappingLength(size_t size) {
+  size_t pagesize = mem_pagesize();
+
+  return (size + MAPPED_HEADER_SIZE + pagesize - 1) & ~(pagesize - 1);
+}
+
+/* Return a payload of size bytes in a new mapping, or NULL if memlib
+   has none to give. */
+static void* mapBlock(size_t size) {
+  size_t length = mappingLength(size);
+  char *mapping = (char *)mem_map(length);
+
+  if (mapping == NULL) {
+    return NULL;
+  }
+  *(size_t *)mapping = length;
+  *(Tag *)(mapping + MAPPED_HEADER_SIZE - HEADER_SIZE) = TAG_MAPPED;
+  return mapping + MAPPED_HEADER_SIZE;
+}
+
+/* Whether the payload at ptr has a mapping of its own. */
+static int isMappedBlock(void* ptr) {
+#if SLAB_MAX_SIZE > 0
+  // Slab objects have no header to look at.
+  if (isSlabObject(ptr)) {
+    return 0;
+  }
+#endif
+  return *(Tag *)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE) == TAG_MAPPED;
+}
+
+/* The room for payload in the mapping of ptr. */
+static size_t mappedPayloadSize(void* ptr) {
+  return *(size_t *)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE) - MAPPED_HEADER_SIZE;
+}
+
+/* Give back the mapping of ptr. */
+static void unmapBlock(void* ptr) {
+  char *mapping = (char *)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE);
+
+  mem_unmap(mapping, *(size_t *)mapping);
+}
+
+/* Resize the mapping of ptr for a payload of size bytes.  Returns the
+   moved payload, or NULL (leaving it as it was) if memlib cannot. */
+static void* remapBlock(void* ptr, size_t size) {
+  char *mapping = (char *)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE);
+  size_t length = mappingLength(size);
+
+  if (length == *(size_t *)mapping) {
+    return ptr;
+  }
+  mapping = (char *)mem_remap(mapping, *(size_t *)mapping, length);
+  if (mapping == NULL) {
+    return NULL;
+  }
+  *(size_t *)mapping = length;
+  return mapping + MAPPED_HEADER_SIZE;
+}
+
+#endif /* MMAP_THRESHOLD */
+
+
+/******** LOCKING ****************************************************/
+
+
+/* The free index and the slabs of an arena are guarded by the arena's
+   lock.  The heap* functions below, and everything they call, work on
+   the current arena and expect the caller to hold its lock (the lock
+   of the arena that owns the block, when one is passed in); the mm_*
+   entry points take it as needed. */
+
+/* Bumped by every mm_init, so that the per-thread caches can tell that
+   the blocks they hold belong to a heap that no longer exists. */
+static unsigned int heapEpoch;
+
+/* The arena the next thread to call the allocator is assigned. */
+static unsigned int nextArena;
+
+static pthread_once_t arenaLocksOnce = PTHREAD_ONCE_INIT;
+
+static void initArenaLocks() {
+  unsigned int id;
+
+  for (id = 0; id < NUM_ARENAS; id++) {
+    pthread_mutex_init(&arenas[id].lock, NULL);
+    arenas[id].id = id;
+  }
+}
+
+
+/* Initialize the allocator. */
+int mm_init () {
+  // Head of the free list.
+  BlockInfo *firstFreeBlock;
+
+  // Initial heap size: HEAP_PROLOGUE_SIZE byte heap-header (stores the
+  // heads of the free lists), MIN_BLOCK_SIZE bytes of space, HEADER_SIZE
+  // byte heap-footer.
+  size_t initSize = HEAP_PROLOGUE_SIZE+MIN_BLOCK_SIZE+HEADER_SIZE;
+  size_t totalSize;
+  void* mem_sbrk_result;
+  char *clean;
+  unsigned int id;
+
+  pthread_once(&arenaLocksOnce, initArenaLocks);
+  lockArena(&arenas[0]);
+  clean = (char *)mem_clean_lo();
+  mem_sbrk_result = mem_sbrk(initSize);
+  //  //printf("mem_sbrk returned %p\n", mem_sbrk_result);
+  if ((ssize_t)mem_sbrk_result == -1) {
+    printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", 
+           mem_sbrk_result);
+    exit(1);
+  }
+
+  heapBase = (char *)mem_heap_lo();
+  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(mem_heap_lo(), HEAP_PROLOGUE_SIZE);
+  // The first segment of the main arena is the start of the heap; the
+  // other arenas have no segment until they are used.
+#if FREE_INDEX != FREE_INDEX_TLSF
+  curArena->prologue = heapBase;
+#endif
+  for (id = 0; id < NUM_ARENAS; id++) {
+    arenas[id].epilogue = NULL;
+    arenas[id].top = NULL;
+    arenas[id].untouched = NULL;
+    arenas[id].maxFreeSize = 0;
+    arenas[id].remoteFrees = NULL;
+    arenas[id].growSize = 0;
+#if QUICK_LISTS > 0
+    memset(arenas[id].quick, 0, sizeof(arenas[id].quick));
+    arenas[id].quickCount = 0;
+#endif
+#if PURGE_MIN_SIZE > 0
+    memset(arenas[id].purge, 0, sizeof(arenas[id].purge));
+    arenas[id].purgeCount = 0;
+#endif
+  }
+  nextArena = 0;
+
+  // Total usable size is full size minus heap-header and heap-footer words
+  // NOTE: These are different than the "header" and "footer" of a block!
+  // The heap-header holds pointers to the first free block of each list.
+  // The heap-footer is used to keep the data structures consistent (see
+  // requestMoreSpace() for more info, but you should be able to ignore it).
+  totalSize = initSize - HEAP_PROLOGUE_SIZE - HEADER_SIZE;
+
+  // The heap starts with one free block, the top chunk, which we
+  // initialize now.
+  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED | TAG_USED;
+  curArena->untouched = clean;
+  setTop(firstFreeBlock);
+  
+  // Tag "useless" word at end of heap as used.
+  // This is the is the heap-footer.
+  curArena->epilogue = (Tag*)UNSCALED_POINTER_SUB(mem_heap_hi(), HEADER_SIZE - 1);
+  *curArena->epilogue = TAG_PRECEDING_USED | TAG_USED;
+  // printf("\nfirstFreeBlock next block: %ld\n", *((Tag*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize)));
+  // empty the free lists; the top chunk is kept out of them.
+  initFreeIndex();
+  initChunkMap();
+#if SLAB_MAX_SIZE > 0
+  initSlabs();
+#endif
+  heapEpoch++;
+  unlockArena();
+  //examine_heap();
+  return 0;
+}
+
+
+// ARENA OPERATIONS (caller holds the arena lock) -------------------
+
+
+/* Allocate a block of size size and return a pointer to it. */
+static void* heapMalloc (size_t size) {
+  BlockInfo * ptrFreeBlock;
+  // Zero-size requests get NULL.
+  if (size == 0) {
+    return NULL;
+  }
+
+#if SLAB_MAX_SIZE > 0
+  // Small requests are carved from a slab of their size class.
+  if (size <= SLAB_MAX_SIZE) {
+    void *obj = slabAlloc(size);
+    if (obj != NULL) {
+      return obj;
     }
-    removeFreeBlock(ptrFreeBlock);
-    // examine_heap();
-    // printf("mm_malloc Compeleted\n");
-    return &(ptrFreeBlock->next);
   }
+#endif
 
-  else
-  {
-    // printf("start requestMoreSpace\n");
-    requestMoreSpace(reqSize);
-    //printf("requestMoreSpace Compeleted\n");
-    goto AfterRequestMoreSpace;
+  ptrFreeBlock = allocBlock(blockSizeFor(size));
+  return &(ptrFreeBlock->next);
+}
+
+/* Split the used block into n used blocks of reqSize bytes, in a single
+   pass, and store their payloads in ptrs. */
+static void splitUsedBlock(BlockInfo* block, size_t reqSize, size_t n, void** ptrs) {
+  size_t left = SIZE(block->sizeAndTags);
+  Tag precedingUsed = block->sizeAndTags & TAG_PRECEDING_USED;
+  size_t i;
+
+  // The last block keeps whatever allocBlock() could not split off.
+  for (i = 0; i < n - 1; i++) {
+    block->sizeAndTags = reqSize | precedingUsed | TAG_USED;
+    ptrs[i] = &(block->next);
+    block = (BlockInfo*)UNSCALED_POINTER_ADD(block, reqSize);
+    left -= reqSize;
+    precedingUsed = TAG_PRECEDING_USED;
   }
+  block->sizeAndTags = left | precedingUsed | TAG_USED;
+  ptrs[n - 1] = &(block->next);
+}
+
+/* Allocate n blocks of size bytes into ptrs.  Blocks too big for a
+   slab are split off free blocks in runs, each run as many blocks as
+   its free block holds, and whatever the free index cannot hold comes
+   off the top chunk in one piece.  Returns how many were allocated: n,
+   or 0 if n blocks of size bytes overflow. */
+static size_t heapMallocBatch(size_t size, size_t n, void** ptrs) {
+  size_t reqSize = blockSizeFor(size);
+  BlockInfo *block;
+  size_t i;
+  size_t run;
 
-  return NULL; 
+#if SLAB_MAX_SIZE > 0
+  if (size <= SLAB_MAX_SIZE) {
+    for (i = 0; i < n; i++) {
+      ptrs[i] = heapMalloc(size);
+    }
+    return n;
+  }
+#endif
+  if (n > SIZE_MAX / reqSize) {
+    return 0;
+  }
+#if QUICK_LISTS > 0
+  consolidateQuickLists();
+#endif
+  for (i = 0; i < n; i += run) {
+    curArena->allocCount++;
+    run = n - i;
+    block = NULL;
+    if (reqSize <= curArena->maxFreeSize) {
+      block = (BlockInfo*)searchFreeList(reqSize);
+      if (block == NULL) {
+        lowerMaxFreeSize(reqSize);
+      }
+    }
+    if (block == NULL) {
+      block = allocFromTop(reqSize * run);
+    } else {
+      if (SIZE(block->sizeAndTags) / reqSize < run) {
+        run = SIZE(block->sizeAndTags) / reqSize;
+      }
+      block = useFreeBlock(block, reqSize * run);
+    }
+    splitUsedBlock(block, reqSize, run, ptrs + i);
+  }
+  return n;
 }
 
+static void heapFreeBlock(void* ptr);
+
 /* Free the block referenced by ptr. */
-void mm_free (void *ptr) {
-  size_t payloadSize;
-  BlockInfo * blockInfo;
-  BlockInfo * followingBlock;
-  // Implement mm_free.  You can change or remove the declaraions
-  // above.  They are included as minor hints.
-  /*keep the info of the current struct*/
-  blockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
-  //printf("free blockInfo: %p\n", blockInfo);
-  blockInfo->sizeAndTags ^= TAG_USED;
-  blockInfo->prev = NULL;
-  payloadSize = SIZE(blockInfo->sizeAndTags) - WORD_SIZE - WORD_SIZE;
-  // set boundary tag
-  *((size_t*)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->sizeAndTags) - WORD_SIZE)) = blockInfo->sizeAndTags;
-  /*keep the info of the following block*/
-  followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(blockInfo, SIZE(blockInfo->sizeAndTags));
-  //if the following block is not last byte
-  if (&followingBlock->sizeAndTags != (size_t*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1))
-  {
-    //set prev use bit to 0
-    followingBlock->sizeAndTags ^= TAG_PRECEDING_USED;
-    // if the following block is in the list
-    if ((followingBlock->sizeAndTags & TAG_USED) == 0)
-    {
-      //set boundary tag
-      *((size_t*)UNSCALED_POINTER_ADD(followingBlock, SIZE(followingBlock->sizeAndTags) - WORD_SIZE)) = followingBlock->sizeAndTags;
-    }
+static void heapFree (void *ptr) {
+#if SLAB_MAX_SIZE > 0
+  if (isSlabObject(ptr)) {
+    slabFree(ptr);
+    return;
   }
-  //if the following block is last byte
-  else
-  {
-    followingBlock->sizeAndTags = TAG_USED;
+#endif
+  heapFreeBlock(ptr);
+}
+
+/* Free the block referenced by ptr, which is not a slab object. */
+static void heapFreeBlock(void* ptr) {
+#if QUICK_LISTS > 0 && TRIM_THRESHOLD > 0
+  // A large block is not parked, and the parked blocks are freed along
+  // with it, so that all of them can merge into the top chunk and be
+  // trimmed.
+  if (SIZE(((BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE))->sizeAndTags) >= TRIM_THRESHOLD / 2) {
+    freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE));
+    consolidateQuickLists();
+    return;
   }
-  insertFreeBlock(blockInfo);
-  coalesceFreeBlock(blockInfo);
-  // examine_heap();
-  // printf("free completed\n");
+#endif
+#if QUICK_LISTS > 0
+  if (pushQuickList((BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE))) {
+    return;
+  }
+#endif
+  freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE));
 }
 
 
+/* Free ptrs[0] together with the blocks among ptrs[1..n-1], sorted by
+   address, that directly follow it in the heap: the run is merged into
+   one block first, so that it is coalesced and indexed once.  Returns
+   how many of the pointers were freed. */
+static size_t heapFreeRun(void** ptrs, size_t n) {
+  BlockInfo *block;
+  size_t size;
+  size_t i;
+
+#if SLAB_MAX_SIZE > 0
+  if (isSlabObject(ptrs[0])) {
+    slabFree(ptrs[0]);
+    return 1;
+  }
+#endif
+  block = (BlockInfo*)UNSCALED_POINTER_SUB(ptrs[0], HEADER_SIZE);
+  size = SIZE(block->sizeAndTags);
+  for (i = 1; i < n && ptrs[i] == UNSCALED_POINTER_ADD(ptrs[0], size); i++) {
+#if SLAB_MAX_SIZE > 0
+    if (isSlabObject(ptrs[i])) {
+      break;
+    }
+#endif
+    size += SIZE(((BlockInfo*)UNSCALED_POINTER_SUB(ptrs[i], HEADER_SIZE))->sizeAndTags);
+  }
+  block->sizeAndTags = size | (block->sizeAndTags & TAG_PRECEDING_USED) | TAG_USED;
+  freeBlock(block);
+#if QUICK_LISTS > 0 && TRIM_THRESHOLD > 0
+  // As in heapFree(), let a large run merge into the top chunk.
+  if (size >= TRIM_THRESHOLD / 2) {
+    consolidateQuickLists();
+  }
+#endif
+  return i;
+}
+
 // Implement a heap consistency checker as needed.
 int mm_check() {
   return 0;
 }
 
 // Extra credit.
-void* mm_realloc(void* ptr, size_t size) {
+static void* heapRealloc(void* ptr, size_t size) {
   // ... implementation here ...
   BlockInfo * reallocblockInfo;
   BlockInfo * nextblockInfo;
   BlockInfo * leftblockafterrealloc;
   BlockInfo * followingBlock;
+  BlockInfo * precedingblockInfo;
   BlockInfo * new_block;
-  size_t oldsize;
+  size_t newsize;
   size_t reqSize;
   size_t precedingBlockUseTag;
   size_t extrasize;
-  size_t sizewithheader;
 
   //If ptr is NULL, then the call is equivalent to malloc(size), for all values of size
   if (ptr == NULL)
   {
-    mm_malloc(size);
+    return heapMalloc(size);
   }
   //if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr).
   else if (size == 0)
   {
-    mm_free(ptr);
+    heapFree(ptr);
+    return NULL;
   }
+#if SLAB_MAX_SIZE > 0
+  // A slab object keeps its place while the new size stays in its size
+  // class, and otherwise moves.
+  else if (isSlabObject(ptr))
+  {
+    size_t oldsize = SLAB_OF(ptr)->objSize;
+
+    if (size <= SLAB_MAX_SIZE && SLAB_CLASS(size) == SLAB_CLASS(oldsize))
+    {
+      return ptr;
+    }
+    new_block = heapMalloc(size);
+    memcpy(new_block, ptr, size < oldsize ? size : oldsize);
+    slabFree(ptr);
+    return new_block;
+  }
+#endif
   else
   {
-    //printf("start realloc\n");
-    sizewithheader = size + WORD_SIZE;
-    // Note that we don't need to boundary tag when the block is used!
-    if (sizewithheader <= MIN_BLOCK_SIZE) {
-      // Make sure we allocate enough space for a blockInfo in case we
-      // free this block (when we free this block, we'll need to use the
-      // next pointer, the prev pointer, and the boundary tag).
-      reqSize = MIN_BLOCK_SIZE;
-    } else {
-      // Round up for correct alignment
-      reqSize = ALIGNMENT * ((sizewithheader + ALIGNMENT - 1) / ALIGNMENT);
+    reqSize = blockSizeFor(size);
+    reallocblockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE);
+#if QUICK_LISTS > 0
+    // A parked neighbor must be merged back before the block can grow
+    // into it (this may change the block's TAG_PRECEDING_USED).
+    if (reqSize > SIZE(reallocblockInfo->sizeAndTags)) {
+      consolidateQuickLists();
     }
-    //printf("reqSize: %ld\n", reqSize);
-    reallocblockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+#endif
     precedingBlockUseTag = reallocblockInfo->sizeAndTags & TAG_PRECEDING_USED;
-    // printf("reallocblockInfo: %p\n", reallocblockInfo);
-    // examine_heap();
-    //printf("Payload of %p: %p -> %p\n", reallocblockInfo, &(reallocblockInfo->next), ((size_t*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags) - 1)));
     //if reqSize > ptr->size
     if (reqSize > SIZE(reallocblockInfo->sizeAndTags))
     {
       extrasize = reqSize - SIZE(reallocblockInfo->sizeAndTags);
       nextblockInfo = (BlockInfo*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags));
-      //printf("nextblockInfo: %p\n", nextblockInfo);
+      // A block followed by the top chunk grows in place, extending the
+      // heap if need be.  If the top chunk no longer ends at the top of
+      // the heap, growing would start a new segment instead, and the
+      // block is moved below.
+      if (nextblockInfo == curArena->top && SIZE(nextblockInfo->sizeAndTags) < extrasize) {
+        requestMoreSpace(extrasize, 1);
+      }
       //if the next block is free and size is enough
       if ((nextblockInfo->sizeAndTags & TAG_USED) == 0 && SIZE(nextblockInfo->sizeAndTags) >= extrasize)
       {
-        //printf("the next block is free and size is enough\n");
       
         //begin to realloc
         removeFreeBlock(nextblockInfo);
@@ -608,43 +2579,76 @@ void* mm_realloc(void* ptr, size_t size) {
         //if next block size > extrasize, the size left after the realloc needs to be added back to the free list
         if ((SIZE(nextblockInfo->sizeAndTags) - extrasize) >= MIN_BLOCK_SIZE)
         {
-          // printf("the size left after the realloc needs to be added back to the free list\n");
-          // examine_heap();
-          reallocblockInfo->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED;
-          // printf("reallocblockInfo->sizeAndTags: %ld\n", SIZE(reallocblockInfo->sizeAndTags));
-          // printf("reallocblockInfo->sizeAndTags: %ld\n", reallocblockInfo->sizeAndTags);
+          reallocblockInfo->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED | TAG_GROWN;
           //left block header
           leftblockafterrealloc = (BlockInfo*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags));
-          //printf("leftblockafterrealloc->sizeAndTags: %p\n", leftblockafterrealloc);
           leftblockafterrealloc->sizeAndTags = (SIZE(nextblockInfo->sizeAndTags) - extrasize) | TAG_PRECEDING_USED;
-          //printf("leftblockafterrealloc->sizeAndTags: %ld\n", leftblockafterrealloc->sizeAndTags);
           //boundary tag
-          *((size_t*)UNSCALED_POINTER_ADD(leftblockafterrealloc, SIZE(leftblockafterrealloc->sizeAndTags) - WORD_SIZE)) = leftblockafterrealloc->sizeAndTags;
-          // printf("insert newBlock: %p\n",newBlock);
+          *((Tag*)UNSCALED_POINTER_ADD(leftblockafterrealloc, SIZE(leftblockafterrealloc->sizeAndTags) - HEADER_SIZE)) = leftblockafterrealloc->sizeAndTags;
           insertFreeBlock(leftblockafterrealloc);
-          //examine_heap();
-          //printf("Payload of %p: %p -> %p\n", reallocblockInfo, &(reallocblockInfo->next), ((size_t*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags) - 1)));
         }
 
         //if there is no memory left, change the status of the next block
         else
         {
-          reallocblockInfo->sizeAndTags = (SIZE(reallocblockInfo->sizeAndTags) + SIZE(nextblockInfo->sizeAndTags)) | precedingBlockUseTag | TAG_USED;
+          reallocblockInfo->sizeAndTags = (SIZE(reallocblockInfo->sizeAndTags) + SIZE(nextblockInfo->sizeAndTags)) | precedingBlockUseTag | TAG_USED | TAG_GROWN;
           followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags));
           followingBlock->sizeAndTags |= TAG_PRECEDING_USED;
         }
-        //printf("&(reallocblockInfo->next): %p\n", &(reallocblockInfo->next));
         return &(reallocblockInfo->next);
       }
+      //if the next block is the top chunk and size is enough
+      else if (nextblockInfo == curArena->top && SIZE(nextblockInfo->sizeAndTags) >= extrasize)
+      {
+        // Move the start of the top chunk past the grown block.
+        followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(nextblockInfo, extrasize);
+        followingBlock->sizeAndTags = (SIZE(nextblockInfo->sizeAndTags) - extrasize) | TAG_PRECEDING_USED | TAG_USED;
+        setTop(followingBlock);
+        reallocblockInfo->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED | TAG_GROWN;
+        return &(reallocblockInfo->next);
+      }
+      //if the preceding block is free and, with the next block if that
+      //is free too, size is enough
+      else if (precedingBlockUseTag == 0 &&
+               (precedingblockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(reallocblockInfo,
+                  SIZE(*(Tag*)UNSCALED_POINTER_SUB(reallocblockInfo, HEADER_SIZE))),
+                newsize = SIZE(precedingblockInfo->sizeAndTags) + SIZE(reallocblockInfo->sizeAndTags) +
+                  ((nextblockInfo->sizeAndTags & TAG_USED) == 0 ? SIZE(nextblockInfo->sizeAndTags) : 0)) >= reqSize)
+      {
+        // Absorb the free neighbors and slide the payload back into the
+        // preceding block.  Free blocks are always coalesced, so
+        // whatever precedes that block is used.
+        removeFreeBlock(precedingblockInfo);
+        if ((nextblockInfo->sizeAndTags & TAG_USED) == 0) {
+          removeFreeBlock(nextblockInfo);
+        }
+        memmove(&(precedingblockInfo->next), ptr, SIZE(reallocblockInfo->sizeAndTags) - HEADER_SIZE);
+        precedingblockInfo->sizeAndTags = newsize | TAG_PRECEDING_USED | TAG_USED | TAG_GROWN;
+        followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(precedingblockInfo, newsize);
+        followingBlock->sizeAndTags |= TAG_PRECEDING_USED;
+        trimUsedBlock(precedingblockInfo, reqSize);
+        return &(precedingblockInfo->next);
+      }
       else
       {
-        // printf("next block is not free or not enough\n");
-        
-        new_block = mm_malloc(size);
-        memcpy(new_block, &(reallocblockInfo->next), SIZE(reallocblockInfo->sizeAndTags)-WORD_SIZE);
-        mm_free(&(reallocblockInfo->next));
-        // printf("Payload of %p: %p -> %p\n", new_block, &(new_block->next), ((size_t*)UNSCALED_POINTER_ADD(new_block, SIZE(new_block->sizeAndTags) - 1)));
-        // examine_heap();
+        // A block that keeps growing gets headroom in proportion to its
+        // size, so that a run of small increments costs an amortized
+        // constant number of copies.
+        newsize = reallocblockInfo->sizeAndTags & TAG_GROWN ? size + size / 2 : size;
+#if MMAP_THRESHOLD > 0
+        // A block outgrowing the heap moves to a mapping of its own,
+        // where it can keep growing without being copied.
+        if (size < MMAP_THRESHOLD || (new_block = mapBlock(size)) == NULL)
+#endif
+        {
+          new_block = heapMalloc(newsize);
+#if SLAB_MAX_SIZE > 0
+          if (!isSlabObject(new_block))
+#endif
+          ((BlockInfo*)UNSCALED_POINTER_SUB(new_block, HEADER_SIZE))->sizeAndTags |= TAG_GROWN;
+        }
+        memcpy(new_block, &(reallocblockInfo->next), SIZE(reallocblockInfo->sizeAndTags)-HEADER_SIZE);
+        heapFree(&(reallocblockInfo->next));
         return new_block;
       }
       
@@ -653,27 +2657,16 @@ void* mm_realloc(void* ptr, size_t size) {
     //if reqSize < ptr->size
     else if (reqSize < SIZE(reallocblockInfo->sizeAndTags))
     {
-      oldsize = SIZE(reallocblockInfo->sizeAndTags);
-      //if the block left is big enough to be in the list
-      if (oldsize - reqSize >= MIN_BLOCK_SIZE)
+      // A grown block keeps its headroom unless it shrinks to less than
+      // half of it.
+      if ((reallocblockInfo->sizeAndTags & TAG_GROWN) && reqSize >= SIZE(reallocblockInfo->sizeAndTags) / 2)
       {
-        reallocblockInfo->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED;
-        //insert the block
-        leftblockafterrealloc = (BlockInfo*)UNSCALED_POINTER_ADD(reallocblockInfo, SIZE(reallocblockInfo->sizeAndTags));
-        leftblockafterrealloc->sizeAndTags = (oldsize - reqSize) | TAG_PRECEDING_USED;
-        //boundary tag
-        *((size_t*)UNSCALED_POINTER_ADD(leftblockafterrealloc, SIZE(leftblockafterrealloc->sizeAndTags) - WORD_SIZE)) = leftblockafterrealloc->sizeAndTags;
-        insertFreeBlock(leftblockafterrealloc);
-        followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(leftblockafterrealloc, SIZE(leftblockafterrealloc->sizeAndTags));
-        followingBlock->sizeAndTags ^= TAG_PRECEDING_USED;
-        if (followingBlock->sizeAndTags & TAG_USED == 0)
-        {
-          *((size_t*)UNSCALED_POINTER_ADD(followingBlock, SIZE(followingBlock->sizeAndTags) - WORD_SIZE)) = followingBlock->sizeAndTags;
-        }
-        
-        coalesceFreeBlock(leftblockafterrealloc);
+        return ptr;
       }
-      //if there is no memory left, change the status of the next block
+      // The tail, if big enough, is freed like any block, which merges
+      // it into a free neighbor or the top chunk.
+      reallocblockInfo->sizeAndTags &= ~TAG_GROWN;
+      trimUsedBlock(reallocblockInfo, reqSize);
       return &(reallocblockInfo->next);
     }
     else
@@ -684,3 +2677,613 @@ void* mm_realloc(void* ptr, size_t size) {
     
   }
 }
+
+
+/******** REMOTE FREES ***********************************************/
+
+
+/* A thread freeing a block that belongs to another arena does not take
+   that arena's lock: it pushes the block on the arena's remote free
+   queue with a single compare-and-swap.  The next thread to allocate
+   from the arena takes the whole queue with one exchange (so there is
+   no ABA problem) and frees the blocks in a batch under the lock it
+   already holds, coalescing them as usual. */
+
+/* Push ptr on arena's remote free queue. */
+static void pushRemoteFree(Arena* arena, void* ptr) {
+  void *head = __atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED);
+
+  do {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&arena->remoteFrees, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free everything on the current arena's remote free queue. */
+static void drainRemoteFrees() {
+  void *ptr;
+  void *next;
+
+  if (__atomic_load_n(&curArena->remoteFrees, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+  ptr = __atomic_exchange_n(&curArena->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+  while (ptr != NULL) {
+    next = *(void **)ptr;
+    heapFree(ptr);
+    ptr = next;
+  }
+}
+
+
+/******** PER-THREAD CACHES ******************************************/
+
+
+/* Each thread keeps, per size class, a LIFO list of blocks it freed
+   (linked through their first payload word), so that most small
+   mallocs and frees touch no shared state and take no lock.  A miss
+   refills a class from the shared heap in one batch, whose size starts
+   at 1 and doubles on each miss up to TCACHE_MAX_COUNT / 2 so that
+   classes a thread rarely uses do not hoard memory; a full class hands
+   half its blocks back in one batch.  Class c holds blocks with room
+   for at least (c + 1) * ALIGNMENT bytes.  Build with
+   -DTCACHE_MAX_SIZE=0 to send every request to the shared heap. */
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 256
+#endif
+
+#ifndef TCACHE_MAX_COUNT
+#define TCACHE_MAX_COUNT 16
+#endif
+
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT)
+
+/* What a thread keeps to itself: its arena and, unless the caches are
+   disabled, its cached blocks. */
+struct ThreadCache {
+  // heapEpoch when the cache was last emptied; a stale cache holds
+  // blocks of a previous heap and is dropped.
+  unsigned int epoch;
+  // The arena the thread allocates from.
+  Arena* arena;
+#if TCACHE_MAX_SIZE > 0
+  void* blocks[TCACHE_CLASSES];
+  unsigned int count[TCACHE_CLASSES];
+  unsigned int batch[TCACHE_CLASSES];
+#endif
+};
+typedef struct ThreadCache ThreadCache;
+
+static __thread ThreadCache tcache;
+
+#if TCACHE_MAX_SIZE > 0
+
+/* Destructor key used to flush the cache of an exiting thread. */
+static pthread_key_t tcacheKey;
+static pthread_once_t tcacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Hand up to n blocks of class 'class' back to the arenas they belong
+   to: the thread's own arena under its lock, the others through their
+   remote free queues. */
+static void flushCacheClass(ThreadCache* cache, int class, unsigned int n) {
+  void *block;
+  Arena *arena;
+
+  while (n-- > 0 && (block = cache->blocks[class]) != NULL) {
+    cache->blocks[class] = *(void **)block;
+    cache->count[class]--;
+    arena = arenaOf(block);
+    if (arena != cache->arena) {
+      pushRemoteFree(arena, block);
+      continue;
+    }
+    if (curArena == NULL) {
+      lockArena(arena);
+    }
+    heapFree(block);
+  }
+  if (curArena != NULL) {
+    unlockArena();
+  }
+}
+
+/* Give everything an exiting thread still caches back to the heap. */
+static void destroyThreadCache(void* arg) {
+  ThreadCache *cache = (ThreadCache *)arg;
+  int class;
+
+  if (cache->epoch != heapEpoch) {
+    return;
+  }
+  for (class = 0; class < TCACHE_CLASSES; class++) {
+    flushCacheClass(cache, class, cache->count[class]);
+  }
+}
+
+static void createCacheKey() {
+  pthread_key_create(&tcacheKey, destroyThreadCache);
+}
+
+#endif /* TCACHE_MAX_SIZE */
+
+/* Start this thread's cache over for the current heap, and assign the
+   thread the next arena. */
+static void resetThreadCache() {
+#if TCACHE_MAX_SIZE > 0
+  if (tcache.epoch == 0) {
+    pthread_once(&tcacheKeyOnce, createCacheKey);
+    pthread_setspecific(tcacheKey, &tcache);
+  }
+#endif
+  memset(&tcache, 0, sizeof(tcache));
+  tcache.epoch = heapEpoch;
+  tcache.arena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+}
+
+/* The arena the calling thread allocates from. */
+static Arena* threadArena() {
+  if (tcache.epoch != heapEpoch) {
+    resetThreadCache();
+  }
+  return tcache.arena;
+}
+
+/* Usable bytes at ptr, found without any lock: the caller owns the
+   block, so its size (or its slab) cannot change.  A thread holding
+   the arena lock may still flip the block's TAG_PRECEDING_USED bit,
+   hence the atomic load. */
+static size_t payloadSize(void* ptr) {
+  BlockInfo *block = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, HEADER_SIZE);
+
+#if SLAB_MAX_SIZE > 0
+  if (isSlabObject(ptr)) {
+    return SLAB_OF(ptr)->objSize;
+  }
+#endif
+#if MMAP_THRESHOLD > 0
+  if (block->sizeAndTags == TAG_MAPPED) {
+    return mappedPayloadSize(ptr);
+  }
+#endif
+  return SIZE(__atomic_load_n(&block->sizeAndTags, __ATOMIC_RELAXED)) - HEADER_SIZE;
+}
+
+#if TCACHE_MAX_SIZE > 0
+
+/* The cache class a payload of 'room' bytes can serve, or -1 if it is
+   too big (or too small) to be cached. */
+static int cacheClassFor(size_t room) {
+  size_t class = room / ALIGNMENT;
+
+  if (class == 0 || class > TCACHE_CLASSES) {
+    return -1;
+  }
+  return class - 1;
+}
+
+/* The least room a block allocated for size bytes has, whichever way
+   it was allocated. */
+static size_t leastRoomFor(size_t size) {
+  size_t room = blockSizeFor(size) - HEADER_SIZE;
+
+#if SLAB_MAX_SIZE > 0
+  if (size <= SLAB_MAX_SIZE && (SLAB_CLASS(size) + 1) * ALIGNMENT < room) {
+    room = (SLAB_CLASS(size) + 1) * ALIGNMENT;
+  }
+#endif
+  return room;
+}
+
+/* Allocate a block of class 'class' from the thread's arena, caching a
+   batch of further blocks of the class while the lock is held. */
+static void* refillCacheClass(int class) {
+  size_t size = (class + 1) * ALIGNMENT;
+  unsigned int n;
+  void *block;
+  void *result;
+
+  if (tcache.batch[class] < TCACHE_MAX_COUNT / 2) {
+    tcache.batch[class] = tcache.batch[class] ? tcache.batch[class] * 2 : 1;
+  }
+  lockArena(tcache.arena);
+  drainRemoteFrees();
+  result = heapMalloc(size);
+  for (n = 1; n < tcache.batch[class]; n++) {
+    block = heapMalloc(size);
+    *(void **)block = tcache.blocks[class];
+    tcache.blocks[class] = block;
+    tcache.count[class]++;
+  }
+  unlockArena();
+  return result;
+}
+
+#endif /* TCACHE_MAX_SIZE */
+
+
+// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+
+
+/* Allocate a block of size size and return a pointer to it.  Safe to
+   call from any thread once mm_init has returned. */
+void* mm_malloc (size_t size) {
+  Arena *arena;
+  void *ptr;
+
+  // Zero-size requests get NULL.
+  if (size == 0) {
+    return NULL;
+  }
+#if MMAP_THRESHOLD > 0
+  if (size >= MMAP_THRESHOLD && (ptr = mapBlock(size)) != NULL) {
+    return ptr;
+  }
+#endif
+  arena = threadArena();
+#if TCACHE_MAX_SIZE > 0
+  if (size <= TCACHE_MAX_SIZE) {
+    int class = (size - 1) / ALIGNMENT;
+    if ((ptr = tcache.blocks[class]) == NULL) {
+      return refillCacheClass(class);
+    }
+    tcache.blocks[class] = *(void **)ptr;
+    tcache.count[class]--;
+    return ptr;
+  }
+#endif
+  lockArena(arena);
+  drainRemoteFrees();
+  ptr = heapMalloc(size);
+  unlockArena();
+  return ptr;
+}
+
+/* Allocate zeroed space for nmemb elements of size bytes each, or
+   return NULL if that is zero bytes or overflows.  A block carved off
+   the untouched end of a top chunk, or with a mapping of its own, is
+   zero already; only recycled space is cleared. */
+void* mm_calloc (size_t nmemb, size_t size) {
+  Arena *arena;
+  void *ptr;
+  int untouched;
+
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  size *= nmemb;
+  if (size == 0) {
+    return NULL;
+  }
+#if MMAP_THRESHOLD > 0
+  if (size >= MMAP_THRESHOLD && (ptr = mapBlock(size)) != NULL) {
+    return ptr;
+  }
+#endif
+#if TCACHE_MAX_SIZE > 0
+  // Cached blocks have all been used before.
+  if (size <= TCACHE_MAX_SIZE) {
+    ptr = mm_malloc(size);
+    memset(ptr, 0, size);
+    return ptr;
+  }
+#endif
+  arena = threadArena();
+  lockArena(arena);
+  drainRemoteFrees();
+  arena->carvedUntouched = 0;
+  ptr = heapMalloc(size);
+  untouched = arena->carvedUntouched;
+#if SLAB_MAX_SIZE > 0
+  // A new slab may be carved off the untouched space, but its objects
+  // are not.
+  if (untouched && isSlabObject(ptr)) {
+    untouched = 0;
+  }
+#endif
+  unlockArena();
+  if (!untouched) {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+/* Allocate a block of size bytes whose payload is a multiple of align
+   (a power of two), or return NULL if size is 0 or align is not a power
+   of two.  The misaligned space in front of the payload is given back
+   as a free block.  The block may be freed or reallocated like any
+   other, though realloc keeps only the default alignment. */
+void* mm_aligned_alloc (size_t align, size_t size) {
+  Arena *arena;
+  BlockInfo *block;
+  void *ptr;
+
+  if (size == 0 || align == 0 || (align & (align - 1)) != 0) {
+    return NULL;
+  }
+  if (align <= ALIGNMENT) {
+    return mm_malloc(size);
+  }
+  if (size > SIZE_MAX / 2 || align > SIZE_MAX / 4) {
+    return NULL;
+  }
+#if MMAP_THRESHOLD > 0
+  // A mapped payload lies MAPPED_HEADER_SIZE past a page boundary;
+  // stricter alignments are carved from the heap.
+  if (size >= MMAP_THRESHOLD && align <= MAPPED_HEADER_SIZE &&
+      (ptr = mapBlock(size)) != NULL) {
+    return ptr;
+  }
+#endif
+  // Slab objects are only ALIGNMENT-aligned, so the block comes from
+  // the heap even if it is small.
+  arena = threadArena();
+  lockArena(arena);
+  drainRemoteFrees();
+  block = allocAlignedBlock(align, size);
+  unlockArena();
+  ptr = &(block->next);
+  return ptr;
+}
+
+/* Free the block referenced by ptr, which was allocated (or last
+   reallocated) for size bytes by any thread; with -DMM_DEBUG, a wrong
+   size is reported.  Knowing the size spares looking up the block's
+   cache class, its slab and its mapping. */
+void mm_free_sized (void *ptr, size_t size) {
+  Arena *arena;
+
+  if (ptr == NULL) {
+    return;
+  }
+#ifdef MM_DEBUG
+  if (size == 0 || size > payloadSize(ptr)
+#if MMAP_THRESHOLD > 0
+      || (isMappedBlock(ptr) && size < MMAP_THRESHOLD)
+#endif
+      ) {
+    printf("ERROR: mm_free_sized(%p, %lu) on a block of %lu usable bytes\n",
+           ptr, (unsigned long)size, (unsigned long)payloadSize(ptr));
+    exit(0);
+  }
+#endif
+#if TCACHE_MAX_SIZE > 0
+  // The block is cached in the class its least room can serve, which
+  // may be below the class its actual room can.
+  if (size <= TCACHE_MAX_SIZE) {
+    int class = cacheClassFor(leastRoomFor(size));
+
+    if (class >= 0) {
+      threadArena();
+      if (tcache.count[class] == TCACHE_MAX_COUNT) {
+        flushCacheClass(&tcache, class, TCACHE_MAX_COUNT / 2);
+      }
+      *(void **)ptr = tcache.blocks[class];
+      tcache.blocks[class] = ptr;
+      tcache.count[class]++;
+      return;
+    }
+  }
+#endif
+#if MMAP_THRESHOLD > 0
+  // Smaller blocks never have a mapping of their own.
+  if (size >= MMAP_THRESHOLD && isMappedBlock(ptr)) {
+    unmapBlock(ptr);
+    return;
+  }
+#endif
+  arena = arenaOf(ptr);
+  if (arena != threadArena()) {
+    pushRemoteFree(arena, ptr);
+    return;
+  }
+  lockArena(arena);
+#if SLAB_MAX_SIZE > 0
+  // Nor are bigger ones slab objects.
+  if (size <= SLAB_MAX_SIZE) {
+    heapFree(ptr);
+  } else
+#endif
+  heapFreeBlock(ptr);
+  unlockArena();
+}
+
+/* How many bytes the block referenced by ptr can hold, which is at
+   least what it was allocated for; 0 for NULL. */
+size_t mm_malloc_usable_size (void *ptr) {
+  return ptr == NULL ? 0 : payloadSize(ptr);
+}
+
+/* Allocate n blocks of size bytes each, storing pointers to them in
+   ptrs.  Returns how many were allocated, which is n unless size is 0
+   or they do not fit in memory. */
+size_t mm_malloc_batch (size_t size, size_t n, void **ptrs) {
+  Arena *arena;
+  size_t i;
+
+  if (size == 0 || n == 0) {
+    return 0;
+  }
+#if MMAP_THRESHOLD > 0
+  // Each of these gets a mapping of its own anyway.
+  if (size >= MMAP_THRESHOLD) {
+    for (i = 0; i < n; i++) {
+      ptrs[i] = mm_malloc(size);
+    }
+    return n;
+  }
+#endif
+  // The batch bypasses the thread cache, which holds single blocks.
+  arena = threadArena();
+  lockArena(arena);
+  drainRemoteFrees();
+  i = heapMallocBatch(size, n, ptrs);
+  unlockArena();
+  return i;
+}
+
+/* Free the block referenced by ptr, which may have been allocated by
+   any thread.  Freeing NULL does nothing. */
+void mm_free (void *ptr) {
+  Arena *arena;
+#if TCACHE_MAX_SIZE > 0
+  int class;
+#endif
+
+  if (ptr == NULL) {
+    return;
+  }
+#if TCACHE_MAX_SIZE > 0
+  class = cacheClassFor(payloadSize(ptr));
+  if (class >= 0) {
+    threadArena();
+    if (tcache.count[class] == TCACHE_MAX_COUNT) {
+      flushCacheClass(&tcache, class, TCACHE_MAX_COUNT / 2);
+    }
+    *(void **)ptr = tcache.blocks[class];
+    tcache.blocks[class] = ptr;
+    tcache.count[class]++;
+    return;
+  }
+#endif
+#if MMAP_THRESHOLD > 0
+  if (isMappedBlock(ptr)) {
+    unmapBlock(ptr);
+    return;
+  }
+#endif
+  arena = arenaOf(ptr);
+  if (arena != threadArena()) {
+    pushRemoteFree(arena, ptr);
+    return;
+  }
+  lockArena(arena);
+  heapFree(ptr);
+  unlockArena();
+}
+
+static int comparePointers(const void* a, const void* b) {
+  uintptr_t x = (uintptr_t)*(void * const *)a;
+  uintptr_t y = (uintptr_t)*(void * const *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Number of pointers mm_free_batch() sorts at a time. */
+#define FREE_BATCH_CHUNK 256
+
+/* Free the n blocks referenced by ptrs (NULL entries are skipped),
+   which may have been allocated by any thread.  The pointers are copied
+   FREE_BATCH_CHUNK at a time and each copy is sorted by address, so
+   that each arena is locked once per run of its blocks and blocks next
+   to each other in the heap are coalesced together; ptrs itself is
+   left as it was. */
+void mm_free_batch (void **ptrs, size_t n) {
+  void *sorted[FREE_BATCH_CHUNK];
+  size_t done, count, i;
+
+  for (done = 0; done < n; done += count) {
+    count = n - done < FREE_BATCH_CHUNK ? n - done : FREE_BATCH_CHUNK;
+    memcpy(sorted, ptrs + done, count * sizeof(void *));
+    qsort(sorted, count, sizeof(void *), comparePointers);
+    i = 0;
+    while (i < count && sorted[i] == NULL) {
+      i++;
+    }
+    while (i < count) {
+      // The lock is taken first even for a mapping (whose arena is just
+      // the main one), so that no header is read while its arena's lock
+      // holder may flip its TAG_PRECEDING_USED.
+      if (curArena != arenaOf(sorted[i])) {
+        if (curArena != NULL) {
+          unlockArena();
+        }
+        lockArena(arenaOf(sorted[i]));
+      }
+#if MMAP_THRESHOLD > 0
+      if (isMappedBlock(sorted[i])) {
+        unmapBlock(sorted[i]);
+        i++;
+        continue;
+      }
+#endif
+      i += heapFreeRun(sorted + i, count - i);
+    }
+  }
+  if (curArena != NULL) {
+    unlockArena();
+  }
+}
+
+/* Resize the block referenced by ptr to size bytes, moving it if
+   needed.  The block stays in the arena it belongs to. */
+void* mm_realloc(void* ptr, size_t size) {
+  void *result;
+
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+#if MMAP_THRESHOLD > 0
+  // A mapped block shrinking below MMAP_THRESHOLD moves into the heap,
+  // so that smaller blocks never have a mapping of their own.
+  if (isMappedBlock(ptr)) {
+    if (size >= MMAP_THRESHOLD) {
+      return remapBlock(ptr, size);
+    }
+    if ((result = mm_malloc(size)) != NULL) {
+      memcpy(result, ptr, size);
+      unmapBlock(ptr);
+    }
+    return result;
+  }
+#endif
+  lockArena(arenaOf(ptr));
+  result = heapRealloc(ptr, size);
+  unlockArena();
+  return result;
+}
+
+/* Give the pages of every large free block back to the system now,
+   instead of once the block has stayed free for the decay period. */
+void mm_purge(void) {
+#if PURGE_MIN_SIZE > 0
+  int id;
+
+  for (id = 0; id < NUM_ARENAS; id++) {
+    lockArena(&arenas[id]);
+    if (arenas[id].epilogue != NULL) {
+      // Blocks freed but not yet in the free index may be large or
+      // merge into large ones.
+      drainRemoteFrees();
+#if QUICK_LISTS > 0
+      consolidateQuickLists();
+#endif
+      purgeArena(1);
+    }
+    unlockArena();
+  }
+#endif
+}
+
+/* Set how many milliseconds a large block stays free before its pages
+   are given back to the system. */
+void mm_purge_decay(long ms) {
+#if PURGE_MIN_SIZE > 0
+  purgeDecayMs = ms;
+#endif
+}
+
+/* Report how many blocks and pages were purged so far, and how many of
+   the purged pages were handed out again. */
+void mm_purge_stats(struct mm_purge_stats *stats) {
+#if PURGE_MIN_SIZE > 0
+  stats->purgedBlocks = __atomic_load_n(&purgedBlocks, __ATOMIC_RELAXED);
+  stats->purgedPages = __atomic_load_n(&purgedPages, __ATOMIC_RELAXED);
+  stats->refaultedPages = __atomic_load_n(&refaultedPages, __ATOMIC_RELAXED);
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
@@ -2,7 +2,23 @@
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_aligned_alloc (size_t align, size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized (void *ptr, size_t size);
+extern size_t mm_malloc_usable_size (void *ptr);
+extern size_t mm_malloc_batch (size_t size, size_t n, void **ptrs);
+extern void mm_free_batch (void **ptrs, size_t n);
 
 // Extra credit
 extern void* mm_realloc(void* ptr, size_t size);
+
+// Giving the pages of large free blocks back to the system
+struct mm_purge_stats {
+  unsigned long purgedBlocks;   // blocks whose pages were given back
+  unsigned long purgedPages;    // resident pages given back
+  unsigned long refaultedPages; // purged pages handed out again
+};
+extern void mm_purge(void);
+extern void mm_purge_decay(long ms);
+extern void mm_purge_stats(struct mm_purge_stats *stats);
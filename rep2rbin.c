@@ -0,0 +1,122 @@
+/*
+ * rep2rbin.c - Convert a .rep trace to the binary .rbin format that the
+ * drivers map and replay in place (see trace.h).
+ *
+ * usage: rep2rbin <in.rep> <out.rbin>
+ *
+ * The records are written in the byte order of this machine, so a .rbin
+ * file is only meant for the machine (or the kind of machine) that wrote
+ * it; the .rep file stays the portable form of a trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024
+
+static void convert_error(char *path, char *msg)
+{
+    printf("ERROR: %s: %s\n", path, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    rbin_header_t header;
+    traceop_t *ops;
+    char type[MAXLINE];
+    unsigned index, size, nmemb, count, align;
+    int i;
+
+    if (argc != 3) {
+        printf("usage: %s <in.rep> <out.rbin>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        convert_error(argv[1], "could not open");
+
+    /* The four header lines of the .rep file */
+    memset(&header, 0, sizeof(header));
+    header.magic = RBIN_MAGIC;
+    header.version = RBIN_VERSION;
+    if (fscanf(in, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+               &header.num_ops, &header.weight) != 4 || header.num_ops < 0)
+        convert_error(argv[1], "bad header");
+    if ((ops = calloc(header.num_ops > 0 ? header.num_ops : 1,
+                      sizeof(traceop_t))) == NULL)
+        convert_error(argv[1], "out of memory");
+
+    /* One record per request line, as the drivers' read_trace builds them */
+    for (i = 0; i < header.num_ops; i++) {
+        if (fscanf(in, "%s", type) != 1)
+            convert_error(argv[1], "fewer requests than the header says");
+        if (isdigit((unsigned char)type[0])) {
+            ops[i].thread = atoi(type);
+            if (fscanf(in, "%s", type) != 1)
+                convert_error(argv[1], "thread id without a request");
+        }
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(in, "%u %u", &index, &size) != 2)
+                convert_error(argv[1], "bad alloc/realloc request");
+            ops[i].type = (type[0] == 'a') ? ALLOC : REALLOC;
+            ops[i].size = size;
+            break;
+        case 'm':
+            if (fscanf(in, "%u %u %u", &index, &align, &size) != 3)
+                convert_error(argv[1], "bad aligned alloc request");
+            ops[i].type = ALIGNED_ALLOC;
+            ops[i].align = align;
+            ops[i].size = size;
+            break;
+        case 'c':
+            if (fscanf(in, "%u %u %u", &index, &nmemb, &size) != 3 || nmemb == 0 ||
+                size > INT_MAX / nmemb)
+                convert_error(argv[1], "bad calloc request");
+            ops[i].type = CALLOC;
+            ops[i].nmemb = nmemb;
+            ops[i].size = nmemb * size;
+            break;
+        case 'f':
+            if (fscanf(in, "%u", &index) != 1)
+                convert_error(argv[1], "bad free request");
+            ops[i].type = FREE;
+            break;
+        case 's':
+            if (fscanf(in, "%u %u", &index, &size) != 2)
+                convert_error(argv[1], "bad sized free request");
+            ops[i].type = FREE_SIZED;
+            ops[i].size = size;
+            break;
+        case 'A':
+        case 'F':
+            if (fscanf(in, "%u %u", &index, &count) != 2 || count == 0 ||
+                (type[0] == 'A' && fscanf(in, "%u", &size) != 1))
+                convert_error(argv[1], "bad batch request");
+            ops[i].type = (type[0] == 'A') ? ALLOC_BATCH : FREE_BATCH;
+            ops[i].count = count;
+            if (type[0] == 'A')
+                ops[i].size = size;
+            break;
+        default:
+            convert_error(argv[1], "bogus type character");
+        }
+        ops[i].index = index;
+    }
+    fclose(in);
+
+    if ((out = fopen(argv[2], "w")) == NULL)
+        convert_error(argv[2], "could not create");
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(ops, sizeof(traceop_t), header.num_ops, out) !=
+        (size_t)header.num_ops || fclose(out) != 0)
+        convert_error(argv[2], "write failed");
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * trace.h - Trace requests as the drivers replay them, and the binary
+ * (.rbin) trace file format that stores them ready to replay.
+ *
+ * A .rbin file is an rbin_header_t followed by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it.  The drivers
+ * map a .rbin file and replay its records in place, with no parsing or
+ * copying; rep2rbin converts a .rep trace to one.
+ */
+#include <stdint.h>
+
+/* Request types, which are also the type codes of .rbin records.  In a
+   .rep file any request may be preceded by the number of the thread
+   that made it, as in "2 a 17 64"; requests without one are thread 0. */
+enum {
+    ALLOC,         /* a <id> <size> */
+    FREE,          /* f <id> */
+    REALLOC,       /* r <id> <size> */
+    CALLOC,        /* c <id> <nmemb> <size> */
+    ALLOC_BATCH,   /* A <id> <count> <size> */
+    FREE_BATCH,    /* F <id> <count> */
+    FREE_SIZED,    /* s <id> <size> */
+    ALIGNED_ALLOC, /* m <id> <align> <size> */
+    NUM_OP_TYPES
+};
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    int type;             /* type of request */
+    int index;            /* index for free() to use later */
+    int size;             /* byte size of alloc/realloc request */
+    union {
+        int nmemb;        /* element count of calloc request */
+        int count;        /* number of ids of a batch request */
+        int align;        /* alignment of aligned alloc request */
+    };
+    int thread;           /* number of the thread that made the request */
+} traceop_t;
+
+/* Number of consecutive block ids, from op->index on, that op uses */
+#define OP_IDS(op) \
+    (((op)->type == ALLOC_BATCH || (op)->type == FREE_BATCH) ? (op)->count : 1)
+
+/* Header of a .rbin file: the four header lines of a .rep file */
+#define RBIN_MAGIC 0x4e49424d  /* "MBIN" read in the writer's byte order */
+#define RBIN_VERSION 2
+
+typedef struct {
+    uint32_t magic;       /* RBIN_MAGIC */
+    uint32_t version;     /* RBIN_VERSION */
+    int sugg_heapsize;    /* suggested heap size (unused) */
+    int num_ids;          /* number of alloc/realloc ids */
+    int num_ops;          /* number of records that follow */
+    int weight;           /* weight for this trace (unused) */
+} rbin_header_t;